@@ -0,0 +1,198 @@
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+#include <unistd.h>
+#include "fs.h"
+
+// Times du, find and tree on a generated tree with one walk thread and
+// with threads walk threads, by default one per cpu. With "compress" it
+// times create and cat of size_mb MiB of text with and without
+// compression instead. The disk file is created in a temporary directory.
+//
+// usage: bench [depth] [fanout] [files_per_dir] [threads]
+//        bench compress [size_mb]
+
+// swallows everything the file system prints while the tree is built
+// and walked
+struct null_buf : std::streambuf
+{
+    int overflow(int c) { return c; }
+};
+
+static unsigned no_dirs = 0, no_files = 0;
+
+static void
+build(FS &fs, const std::string &path, unsigned depth, unsigned fanout, unsigned files)
+{
+    for (unsigned i = 0; i < files; i++) {
+        std::istringstream data("file " + std::to_string(i) + "\n\n");
+        std::streambuf *in = std::cin.rdbuf(data.rdbuf());
+        fs.create(path + "/f" + std::to_string(i));
+        std::cin.rdbuf(in);
+        no_files++;
+    }
+    if (depth == 0)
+        return;
+    for (unsigned i = 0; i < fanout; i++) {
+        std::string sub = path + "/d" + std::to_string(i);
+        fs.mkdir(sub);
+        no_dirs++;
+        build(fs, sub, depth - 1, fanout, files);
+    }
+}
+
+static double
+time_ms(FS &fs, const char *cmd)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (std::string(cmd) == "du")
+        fs.du("/");
+    else if (std::string(cmd) == "find")
+        fs.find("no-such-name");
+    else
+        fs.tree("/");
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// size_mb MiB of text made of the lines of test_commands.txt, or of
+// generated lines if it cannot be read
+static std::string
+make_text(unsigned size_mb)
+{
+    std::vector<std::string> lines;
+    std::ifstream file("test_commands.txt");
+    for (std::string line; std::getline(file, line);)
+        if (!line.empty())
+            lines.push_back(line);
+    if (lines.empty())
+        for (unsigned i = 0; i < 64; i++)
+            lines.push_back("create file" + std::to_string(i) + " with some text in it");
+
+    std::string text;
+    for (unsigned i = 0; text.size() < (size_t)size_mb << 20; i++)
+        text += lines[i % lines.size()] + " " + std::to_string(i % 1000) + "\n";
+    return text;
+}
+
+// KiB used below the root directory, as printed by du
+static unsigned long
+kib_used(FS &fs)
+{
+    std::ostringstream du;
+    std::streambuf *out = std::cout.rdbuf(du.rdbuf());
+    fs.du("/");
+    std::cout.rdbuf(out);
+    std::string last = du.str();
+    last = last.substr(last.rfind('\n', last.size() - 2) + 1);
+    return std::strtoul(last.c_str(), nullptr, 10);
+}
+
+static int
+compress_bench(unsigned size_mb, const std::string &text)
+{
+    null_buf null;
+    std::ostream sink(&null);
+    std::streambuf *out = std::cout.rdbuf(&null);
+    std::ostringstream report;
+    report << size_mb << " MiB of text\n";
+    report << "mode          create MB/s   cat MB/s   KiB used\n";
+
+    for (bool compress : {false, true}) {
+        fs_options options;
+        options.compress = compress;
+        FS fs(options);
+        fs.format(((unsigned long)size_mb << 8) * 2 + 1024);
+
+        std::istringstream data(text + "\n");
+        std::streambuf *in = std::cin.rdbuf(data.rdbuf());
+        auto start = std::chrono::steady_clock::now();
+        fs.create("text");
+        std::chrono::duration<double> create = std::chrono::steady_clock::now() - start;
+        std::cin.rdbuf(in);
+
+        fs.cat("text", sink); // warm the page cache
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 3; i++)
+            fs.cat("text", sink);
+        std::chrono::duration<double> cat = (std::chrono::steady_clock::now() - start) / 3;
+
+        double mb = text.size() / 1e6;
+        report << std::left << std::setw(14) << (compress ? "compressed" : "plain") << std::right
+               << std::setw(11) << std::fixed << std::setprecision(1) << mb / create.count()
+               << std::setw(11) << mb / cat.count()
+               << std::setw(11) << kib_used(fs) << "\n";
+    }
+
+    std::cout.rdbuf(out);
+    std::cout << report.str();
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1 && std::string(argv[1]) == "compress") {
+        unsigned size_mb = argc > 2 ? std::atoi(argv[2]) : 8;
+        std::string text = make_text(size_mb);
+        char dir[] = "/tmp/fs-bench-XXXXXX";
+        if (!mkdtemp(dir) || chdir(dir)) {
+            std::cerr << "Could not create a temporary directory\n";
+            return 1;
+        }
+        int ret = compress_bench(size_mb, text);
+        unlink(DISKNAME);
+        rmdir(dir);
+        return ret;
+    }
+
+    unsigned depth = argc > 1 ? std::atoi(argv[1]) : 6;
+    unsigned fanout = argc > 2 ? std::atoi(argv[2]) : 4;
+    unsigned files = argc > 3 ? std::atoi(argv[3]) : 8;
+
+    char dir[] = "/tmp/fs-bench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir)) {
+        std::cerr << "Could not create a temporary directory\n";
+        return 1;
+    }
+
+    null_buf null;
+    std::streambuf *out = std::cout.rdbuf(&null);
+
+    unsigned threads = argc > 4 ? std::atoi(argv[4]) : std::max(1u, std::thread::hardware_concurrency());
+    std::ostringstream report;
+    {
+        FS fs;
+        // every directory and file takes one block
+        unsigned long blocks = 1;
+        for (unsigned d = 0, level = 1; d <= depth; d++, level *= fanout)
+            blocks += (unsigned long)level * (files + 1) * 2;
+        fs.format(std::max<unsigned long>(blocks + 1024, NO_BLOCKS));
+        build(fs, "", depth, fanout, files);
+    }
+    report << no_dirs << " directories, " << no_files << " files, depth " << depth << "\n";
+    report << "threads      du    find    tree (ms)\n";
+
+    for (unsigned t : {1u, threads}) {
+        fs_options options;
+        options.walk_threads = t;
+        FS fs(options);
+        time_ms(fs, "du"); // warm the page cache
+        report << std::setw(7) << t;
+        for (const char *cmd : {"du", "find", "tree"})
+            report << std::setw(8) << std::fixed << std::setprecision(1) << time_ms(fs, cmd);
+        report << "\n";
+    }
+
+    std::cout.rdbuf(out);
+    std::cout << report.str();
+
+    unlink(DISKNAME);
+    rmdir(dir);
+    return 0;
+}
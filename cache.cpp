@@ -0,0 +1,175 @@
+#include <iostream>
+#include <cstring>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk &disk, unsigned capacity) : disk(disk), capacity(capacity)
+{
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+// finds a cached block and moves it first in the LRU list
+BlockCache::cache_line *
+BlockCache::lookup(unsigned block_no)
+{
+    auto it = lines.find(block_no);
+    if (it == lines.end())
+        return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return &*it->second;
+}
+
+// adds a new (clean) line for block_no, evicting the least recently used
+// line if the cache is full
+BlockCache::cache_line *
+BlockCache::insert(unsigned block_no)
+{
+    if (lru.size() >= capacity && evict())
+        return nullptr;
+    lru.emplace_front();
+    cache_line &line = lru.front();
+    line.block_no = block_no;
+    line.dirty = false;
+    lines[block_no] = lru.begin();
+    return &line;
+}
+
+// removes the least recently used line, writing it back if it is dirty
+int
+BlockCache::evict()
+{
+    if (lru.empty())
+        return 0;
+    cache_line &line = lru.back();
+    if (line.dirty) {
+        if (disk.write(line.block_no, line.data))
+            return -1;
+        writebacks++;
+    }
+    lines.erase(line.block_no);
+    lru.pop_back();
+    return 0;
+}
+
+// reads one block, from memory if it is cached
+int
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    if (DEBUG)
+        std::cout << "BlockCache::read(" << block_no << ")\n";
+    cache_line *line = lookup(block_no);
+    if (line) {
+        hits++;
+        std::memcpy(blk, line->data, BLOCK_SIZE);
+        return 0;
+    }
+    misses++;
+    if (capacity == 0)
+        return disk.read(block_no, blk);
+    if (disk.read(block_no, blk))
+        return -1;
+    line = insert(block_no);
+    if (line)
+        std::memcpy(line->data, blk, BLOCK_SIZE);
+    return 0;
+}
+
+// writes one block to the cache, the disk is updated at eviction or sync
+int
+BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    if (DEBUG)
+        std::cout << "BlockCache::write(" << block_no << ")\n";
+    if (capacity == 0)
+        return disk.write(block_no, blk);
+    if (block_no >= disk.get_no_blocks()) {
+        std::cout << "BlockCache::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    cache_line *line = lookup(block_no);
+    if (!line)
+        line = insert(block_no);
+    if (!line)
+        return disk.write(block_no, blk);
+    std::memcpy(line->data, blk, BLOCK_SIZE);
+    line->dirty = true;
+    return 0;
+}
+
+// reads many blocks at once, cached blocks are copied from memory and the
+// uncached ones are read from the disk in as few transfers as possible
+int
+BlockCache::read_blocks(const std::vector<unsigned> &block_nos, uint8_t *buf)
+{
+    std::vector<unsigned> pending;
+    unsigned pending_start = 0;
+    for (unsigned i = 0; i <= block_nos.size(); i++) {
+        auto it = i < block_nos.size() ? lines.find(block_nos[i]) : lines.end();
+        if (i < block_nos.size() && it == lines.end()) {
+            // not cached, read it together with its uncached neighbours
+            if (pending.empty())
+                pending_start = i;
+            pending.push_back(block_nos[i]);
+            misses++;
+            continue;
+        }
+        if (!pending.empty()) {
+            if (disk.read_blocks(pending, buf + (size_t)pending_start * BLOCK_SIZE))
+                return -1;
+            pending.clear();
+        }
+        if (i < block_nos.size()) {
+            hits++;
+            std::memcpy(buf + (size_t)i * BLOCK_SIZE, it->second->data, BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+// writes many blocks at once straight to the disk, cached copies of the
+// blocks are updated and become clean
+int
+BlockCache::write_blocks(const std::vector<unsigned> &block_nos, const uint8_t *buf)
+{
+    if (disk.write_blocks(block_nos, buf))
+        return -1;
+    for (unsigned i = 0; i < block_nos.size(); i++) {
+        auto it = lines.find(block_nos[i]);
+        if (it == lines.end())
+            continue;
+        std::memcpy(it->second->data, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        it->second->dirty = false;
+    }
+    return 0;
+}
+
+// writes all dirty blocks to the disk
+int
+BlockCache::sync()
+{
+    int ret = 0;
+    for (auto &line : lru) {
+        if (!line.dirty)
+            continue;
+        if (disk.write(line.block_no, line.data)) {
+            ret = -1;
+            continue;
+        }
+        line.dirty = false;
+        writebacks++;
+    }
+    if (disk.sync())
+        ret = -1;
+    return ret;
+}
+
+// drops every cached block without writing it back
+void
+BlockCache::invalidate()
+{
+    lines.clear();
+    lru.clear();
+}
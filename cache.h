@@ -0,0 +1,59 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#define CACHE_BLOCKS 64
+
+// Write-back block cache between the file system and the disk.
+// Blocks are evicted in LRU order, dirty blocks are written to the disk
+// when they are evicted or when sync() is called.
+class BlockCache {
+private:
+    struct cache_line {
+        unsigned block_no;
+        bool dirty;
+        uint8_t data[BLOCK_SIZE];
+    };
+    Disk &disk;
+    unsigned capacity;
+    // most recently used line first
+    std::list<cache_line> lru;
+    std::unordered_map<unsigned, std::list<cache_line>::iterator> lines;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    unsigned long writebacks = 0;
+    cache_line *lookup(unsigned block_no);
+    cache_line *insert(unsigned block_no);
+    int evict();
+public:
+    BlockCache(Disk &disk, unsigned capacity = CACHE_BLOCKS);
+    ~BlockCache();
+    // reads one block, from memory if it is cached
+    int read(unsigned block_no, uint8_t *blk);
+    // writes one block to the cache, the disk is updated at eviction or sync
+    int write(unsigned block_no, uint8_t *blk);
+    // reads many blocks at once, see Disk::read_blocks. Cached blocks are
+    // copied from memory, the rest are read from the disk without being
+    // added to the cache so bulk file data does not push out metadata.
+    int read_blocks(const std::vector<unsigned> &block_nos, uint8_t *buf);
+    // writes many blocks at once straight to the disk, cached copies of
+    // the blocks are updated and become clean
+    int write_blocks(const std::vector<unsigned> &block_nos, const uint8_t *buf);
+    // writes all dirty blocks to the disk
+    int sync();
+    // drops every cached block without writing it back
+    void invalidate();
+    unsigned get_capacity() { return capacity; }
+    unsigned get_resident() { return lru.size(); }
+    unsigned long get_hits() { return hits; }
+    unsigned long get_misses() { return misses; }
+    unsigned long get_writebacks() { return writebacks; }
+};
+
+#endif // __CACHE_H__
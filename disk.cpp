@@ -1,27 +1,75 @@
 #include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "disk.h"
 
-Disk::Disk()
+Disk::Disk(const disk_options &options) : backend(options.backend)
 {
     // first check if the disk file exists, otherwise create it.
     if (!disk_file_exists(DISKNAME)) {
         std::cout << "No disk file found...\n";
         std::cout << "Creating disk file: " << DISKNAME << std::endl;
         std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        f.seekp((uint64_t)BLOCK_SIZE * NO_BLOCKS - 1);
         f.write("", 1);
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
+    fd = open(DISKNAME, O_RDWR);
+    if (fd == -1) {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
         exit(-1);
     }
+    // the number of blocks is given by the size of the disk file
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= BLOCK_SIZE) {
+        no_blocks = st.st_size / BLOCK_SIZE;
+        disk_size = (uint64_t)BLOCK_SIZE * no_blocks;
+    }
+    if (backend == BACKEND_MMAP && !open_mapping()) {
+        std::cerr << "WARNING: Can't map diskfile: " << DISKNAME << ", using pread/pwrite\n";
+        backend = BACKEND_PREAD;
+    }
+    if (backend == BACKEND_URING) {
+        uring = new IoUring(options.queue_depth ? options.queue_depth : 1);
+        if (!uring->ok()) {
+            std::cerr << "WARNING: io_uring not available, using pread/pwrite\n";
+            delete uring;
+            uring = nullptr;
+            backend = BACKEND_PREAD;
+        }
+    }
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    close_mapping();
+    delete uring;
+    close(fd);
+}
+
+// maps the whole disk file into memory, returns false on failure
+bool
+Disk::open_mapping()
+{
+    void *addr = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+    mapping = (uint8_t *)addr;
+    return true;
+}
+
+// flushes and removes the mapping, if there is one
+void
+Disk::close_mapping()
+{
+    if (!mapping)
+        return;
+    msync(mapping, disk_size, MS_SYNC);
+    munmap(mapping, disk_size);
+    mapping = nullptr;
 }
 
 bool
@@ -30,6 +78,32 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
+// moves count adjacent blocks starting at block_no between buf and the disk
+int
+Disk::transfer(bool to_disk, unsigned block_no, unsigned count, uint8_t *buf)
+{
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    if (mapping) {
+        if (to_disk)
+            std::memcpy(mapping + offset, buf, len);
+        else
+            std::memcpy(buf, mapping + offset, len);
+        return 0;
+    }
+    while (len > 0) {
+        ssize_t n = to_disk ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (n <= 0) {
+            std::cout << "Disk::transfer - ERROR: I/O error at offset " << offset << "\n";
+            return -1;
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
 // writes one block to the disk
 int
 Disk::write(unsigned block_no, uint8_t *blk)
@@ -41,11 +115,7 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
-    return 0;
+    return transfer(true, block_no, 1, blk);
 }
 
 // reads one block from the disk
@@ -56,11 +126,160 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
     if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        std::cout << "Disk::read - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    return transfer(false, block_no, 1, blk);
+}
+
+// splits block_nos into runs of adjacent blocks and moves each run in one
+// transfer, or submits them all to io_uring
+int
+Disk::transfer_blocks(bool to_disk, const std::vector<unsigned> &block_nos, uint8_t *buf)
+{
+    std::vector<unsigned> starts, counts;
+    std::vector<size_t> positions;
+    for (unsigned i = 0; i < block_nos.size();) {
+        unsigned run = 1;
+        while (i + run < block_nos.size() && block_nos[i + run] == block_nos[i] + run)
+            run++;
+        if (block_nos[i] + run > no_blocks) {
+            std::cout << "Disk::transfer_blocks - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+        starts.push_back(block_nos[i]);
+        counts.push_back(run);
+        positions.push_back((size_t)i * BLOCK_SIZE);
+        i += run;
+    }
+    if (uring && starts.size() > 1)
+        return transfer_uring(to_disk, starts, counts, positions, buf);
+    for (unsigned i = 0; i < starts.size(); i++)
+        if (transfer(to_disk, starts[i], counts[i], buf + positions[i]))
+            return -1;
     return 0;
 }
+
+// keeps up to queue depth runs in flight and resubmits the rest of a run
+// after a short transfer
+int
+Disk::transfer_uring(bool to_disk, const std::vector<unsigned> &starts,
+                     const std::vector<unsigned> &counts, const std::vector<size_t> &positions, uint8_t *buf)
+{
+    std::vector<size_t> done(starts.size(), 0);
+    std::vector<unsigned> retry;
+    unsigned next = 0, in_flight = 0;
+    int ret = 0;
+    while (next < starts.size() || !retry.empty() || in_flight) {
+        // fill the submission queue, short transfers first
+        while (in_flight < uring->get_depth() && (!retry.empty() || next < starts.size())) {
+            unsigned i;
+            if (!retry.empty()) {
+                i = retry.back();
+                retry.pop_back();
+            } else {
+                i = next++;
+            }
+            size_t len = (size_t)counts[i] * BLOCK_SIZE;
+            off_t offset = (off_t)starts[i] * BLOCK_SIZE + done[i];
+            if (!uring->queue(to_disk, fd, buf + positions[i] + done[i], len - done[i], offset, i)) {
+                retry.push_back(i);
+                break;
+            }
+            in_flight++;
+        }
+        if (uring->submit(1)) {
+            std::cout << "Disk::transfer_uring - ERROR: io_uring_enter failed\n";
+            return -1;
+        }
+        uint64_t tag;
+        int result;
+        while (uring->reap(tag, result)) {
+            in_flight--;
+            if (result <= 0) {
+                std::cout << "Disk::transfer_uring - ERROR: I/O error at block " << starts[tag] << "\n";
+                ret = -1;
+                continue;
+            }
+            done[tag] += result;
+            if (done[tag] < (size_t)counts[tag] * BLOCK_SIZE)
+                retry.push_back(tag);
+        }
+        // stop queueing after an error, but collect what is in flight
+        if (ret) {
+            next = starts.size();
+            retry.clear();
+        }
+    }
+    return ret;
+}
+
+// reads the blocks in block_nos into buf, block i is placed at
+// buf + i * BLOCK_SIZE. Runs of adjacent blocks are read in one transfer.
+int
+Disk::read_blocks(const std::vector<unsigned> &block_nos, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::read_blocks(" << block_nos.size() << " blocks)\n";
+    return transfer_blocks(false, block_nos, buf);
+}
+
+// writes buf to the blocks in block_nos, the counterpart of read_blocks
+int
+Disk::write_blocks(const std::vector<unsigned> &block_nos, const uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::write_blocks(" << block_nos.size() << " blocks)\n";
+    return transfer_blocks(true, block_nos, (uint8_t *)buf);
+}
+
+// flushes written blocks to the disk file
+int
+Disk::sync()
+{
+    if (mapping)
+        return msync(mapping, disk_size, MS_SYNC) ? -1 : 0;
+    return fdatasync(fd) ? -1 : 0;
+}
+
+// grows or shrinks the disk file to no_blocks blocks
+int
+Disk::resize(unsigned no_blocks)
+{
+    if (no_blocks == this->no_blocks)
+        return 0;
+    bool mapped = mapping != nullptr;
+    close_mapping();
+    uint64_t size = (uint64_t)BLOCK_SIZE * no_blocks;
+    int ret = ftruncate(fd, size) ? -1 : 0;
+    if (ret == 0) {
+        this->no_blocks = no_blocks;
+        disk_size = size;
+    } else {
+        std::cout << "Disk::resize - ERROR: Can't resize disk to " << no_blocks << " blocks\n";
+    }
+    if (mapped && !open_mapping()) {
+        std::cerr << "WARNING: Can't map diskfile: " << DISKNAME << ", using pread/pwrite\n";
+        backend = BACKEND_PREAD;
+    }
+    return ret;
+}
+
+// sets every block on the disk to zero by truncating the disk file and
+// growing it again, so no block has to be written
+int
+Disk::erase()
+{
+    bool mapped = mapping != nullptr;
+    close_mapping();
+    int ret = 0;
+    if (ftruncate(fd, 0) || ftruncate(fd, disk_size)) {
+        std::cout << "Disk::erase - ERROR: Can't erase disk\n";
+        ret = -1;
+    }
+    if (mapped && !open_mapping()) {
+        std::cerr << "WARNING: Can't map diskfile: " << DISKNAME << ", using pread/pwrite\n";
+        backend = BACKEND_PREAD;
+    }
+    return ret;
+}
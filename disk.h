@@ -1,28 +1,63 @@
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include "uring.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
 #define BLOCK_SIZE 4096
+#define NO_BLOCKS 2048 // size of a new disk file, and of every v1 volume
 #define DEBUG false
 
+#define BACKEND_PREAD 0
+#define BACKEND_MMAP 1
+#define BACKEND_URING 2
+
+struct disk_options
+{
+    int backend = BACKEND_PREAD;              // how the disk file is accessed
+    unsigned queue_depth = URING_QUEUE_DEPTH; // requests in flight for io_uring
+};
+
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    int backend;
+    int fd = -1;
+    uint8_t *mapping = nullptr;
+    IoUring *uring = nullptr;
+    unsigned no_blocks = NO_BLOCKS;
+    uint64_t disk_size = (uint64_t)BLOCK_SIZE * NO_BLOCKS;
     bool disk_file_exists (const std::string& name);
+    bool open_mapping();
+    void close_mapping();
+    int transfer(bool to_disk, unsigned block_no, unsigned count, uint8_t *buf);
+    int transfer_blocks(bool to_disk, const std::vector<unsigned> &block_nos, uint8_t *buf);
+    int transfer_uring(bool to_disk, const std::vector<unsigned> &starts,
+                       const std::vector<unsigned> &counts, const std::vector<size_t> &positions, uint8_t *buf);
 public:
-    Disk();
+    Disk(const disk_options &options = disk_options());
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
+    int get_backend() { return backend; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads the blocks in block_nos into buf, block i is placed at
+    // buf + i * BLOCK_SIZE. Runs of adjacent blocks are read in one transfer,
+    // with the io_uring backend all runs are in flight at the same time.
+    int read_blocks(const std::vector<unsigned> &block_nos, uint8_t *buf);
+    // writes buf to the blocks in block_nos, the counterpart of read_blocks
+    int write_blocks(const std::vector<unsigned> &block_nos, const uint8_t *buf);
+    // flushes written blocks to the disk file
+    int sync();
+    // grows or shrinks the disk file to no_blocks blocks
+    int resize(unsigned no_blocks);
+    // sets every block on the disk to zero
+    int erase();
 };
 
 #endif // __DISK_H__
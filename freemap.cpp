@@ -0,0 +1,138 @@
+#include "freemap.h"
+
+// marks all no_blocks blocks as used
+void
+FreeMap::reset(unsigned no_blocks)
+{
+    this->no_blocks = no_blocks;
+    words.assign((no_blocks + 63) / 64, 0);
+    no_free = 0;
+    hint = 0;
+    runs.clear();
+    runs_by_length.clear();
+}
+
+void
+FreeMap::set_free(unsigned block_no)
+{
+    if (block_no >= no_blocks || is_free(block_no))
+        return;
+    words[block_no / 64] |= (uint64_t)1 << (block_no % 64);
+    no_free++;
+    if (block_no / 64 < hint)
+        hint = block_no / 64;
+
+    // Join the runs ending right before and starting right after block_no
+    unsigned start = block_no, length = 1;
+    auto next = runs.find(block_no + 1);
+    if (next != runs.end()) {
+        length += next->second;
+        remove_run(next);
+    }
+    auto prev = runs.lower_bound(block_no);
+    if (prev != runs.begin() && (--prev)->first + prev->second == block_no) {
+        start = prev->first;
+        length += prev->second;
+        remove_run(prev);
+    }
+    add_run(start, length);
+}
+
+void
+FreeMap::set_used(unsigned block_no)
+{
+    if (block_no >= no_blocks || !is_free(block_no))
+        return;
+    words[block_no / 64] &= ~((uint64_t)1 << (block_no % 64));
+    no_free--;
+
+    // Split the run holding block_no around it
+    auto run = --runs.upper_bound(block_no);
+    unsigned start = run->first, end = run->first + run->second;
+    remove_run(run);
+    if (start < block_no)
+        add_run(start, block_no - start);
+    if (block_no + 1 < end)
+        add_run(block_no + 1, end - block_no - 1);
+}
+
+void
+FreeMap::add_run(unsigned start, unsigned length)
+{
+    runs[start] = length;
+    runs_by_length.insert({length, start});
+}
+
+void
+FreeMap::remove_run(std::map<unsigned, unsigned>::iterator run)
+{
+    runs_by_length.erase({run->second, run->first});
+    runs.erase(run);
+}
+
+bool
+FreeMap::is_free(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return false;
+    return (words[block_no / 64] >> (block_no % 64)) & 1;
+}
+
+// returns the lowest free block, or -1 if the disk is full. The words
+// before hint are known to be full, so repeated allocations only look at
+// each word once.
+int
+FreeMap::find_free()
+{
+    if (no_free == 0)
+        return -1;
+    for (unsigned i = hint; i < words.size(); i++) {
+        if (words[i]) {
+            hint = i;
+            return i * 64 + __builtin_ctzll(words[i]);
+        }
+    }
+    hint = words.size();
+    return -1;
+}
+
+// number of free blocks in the run starting at block_no, at most max
+unsigned
+FreeMap::run_length(unsigned block_no, unsigned max)
+{
+    unsigned length = 0;
+    while (length < max && is_free(block_no + length))
+        length++;
+    return length;
+}
+
+// sets run to the smallest run of at least size blocks, the first one in
+// block order if there are several. Returns false if there is none.
+bool
+FreeMap::best_fit(unsigned size, extent &run)
+{
+    auto it = runs_by_length.lower_bound({size, 0});
+    if (it == runs_by_length.end())
+        return false;
+    run = {it->second, it->first};
+    return true;
+}
+
+// returns the longest runs until they hold size blocks, runs of the same
+// length are taken in block order
+std::vector<extent>
+FreeMap::longest_runs(unsigned size)
+{
+    std::vector<extent> result;
+    unsigned found = 0;
+    auto end = runs_by_length.end();
+    while (end != runs_by_length.begin() && found < size) {
+        auto group = runs_by_length.lower_bound({std::prev(end)->first, 0});
+        for (auto it = group; it != end && found < size; ++it) {
+            result.push_back({it->second, it->first});
+            found += it->first;
+        }
+        end = group;
+    }
+    return result;
+}
@@ -0,0 +1,50 @@
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+struct extent
+{
+    unsigned start;  // first block of the run
+    unsigned length; // number of adjacent blocks
+};
+
+// Bitmap of the free blocks on the disk, kept next to the FAT so that
+// allocation does not have to scan the FAT. A set bit means a free block.
+class FreeMap {
+private:
+    std::vector<uint64_t> words;
+    unsigned no_blocks = 0;
+    unsigned no_free = 0;
+    // no word before hint has a free block
+    unsigned hint = 0;
+    // the runs of free blocks by first block, and by (length, first block),
+    // kept up to date block by block so allocation never scans the bitmap
+    std::map<unsigned, unsigned> runs;
+    std::set<std::pair<unsigned, unsigned>> runs_by_length;
+    void add_run(unsigned start, unsigned length);
+    void remove_run(std::map<unsigned, unsigned>::iterator run);
+public:
+    // marks all no_blocks blocks as used
+    void reset(unsigned no_blocks);
+    void set_free(unsigned block_no);
+    void set_used(unsigned block_no);
+    bool is_free(unsigned block_no);
+    // returns the lowest free block, or -1 if the disk is full
+    int find_free();
+    // number of free blocks in the run starting at block_no, at most max
+    unsigned run_length(unsigned block_no, unsigned max);
+    // sets run to the smallest run of at least size blocks, the first one
+    // in block order if there are several. Returns false if there is none.
+    bool best_fit(unsigned size, extent &run);
+    // returns the longest runs, first in block order among runs of the same
+    // length, until they hold size blocks
+    std::vector<extent> longest_runs(unsigned size);
+    unsigned get_no_runs() { return runs.size(); }
+    unsigned get_no_free() { return no_free; }
+};
+
+#endif // __FREEMAP_H__
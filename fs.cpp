@@ -1,77 +1,110 @@
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 #include "fs.h"
 
-FS::FS()
+// 64-bit FNV-1a hash of length bytes of data, continuing from hash
+static uint64_t hashBytes(const uint8_t *data, size_t length, uint64_t hash)
 {
-  std::cout << "FS::FS()... Creating file system\n";
-
-  // Initialize empty working directory
-  std::string empty_name = "";
-  dir_entry dir_ent;
-  std::strcpy(dir_ent.file_name, empty_name.c_str());
-  dir_ent.size = 0;
-  dir_ent.first_blk = 0;
-  dir_ent.type = TYPE_EMPTY;
-  dir_ent.access_rights = 0;
-
-  for (auto &dir : working_directory)
+  for (size_t i = 0; i < length; i++)
   {
-    dir = dir_ent;
+    hash ^= data[i];
+    hash *= FNV_PRIME;
   }
+  return hash;
+}
+
+FS::FS(const fs_options &options) : disk(options.disk), cache(disk, options.cache_blocks),
+  pool((options.walk_threads ? options.walk_threads : std::max(1u, std::thread::hardware_concurrency())) - 1),
+  dedup(options.dedup), compress(options.compress)
+{
+  std::cout << "FS::FS()... Creating file system\n";
+  mount();
 }
 
 FS::~FS()
 {
+  writeDedup();
+  writeFAT();
+  cache.sync();
 }
 
-// formats the disk, i.e., creates an empty file system
-int FS::format()
+// formats the disk, i.e., creates an empty file system with no_blocks
+// blocks of block_size bytes
+int FS::format(unsigned no_blocks, unsigned block_size)
 {
+  if (block_size != BLOCK_SIZE)
+  {
+    std::cout << "Block size " << block_size << " not supported, only " << BLOCK_SIZE << std::endl;
+    return -1;
+  }
+
+  unsigned fat_blocks = (no_blocks + FAT_ENTRIES - 1) / FAT_ENTRIES;
+  if (no_blocks < SUPER_BLOCK + 1 + fat_blocks + 1 || no_blocks > INT32_MAX)
+  {
+    std::cout << "Invalid number of blocks " << no_blocks << std::endl;
+    return -1;
+  }
+
   cwd = ROOT_BLOCK;
+  cwd_path = "/";
 
   // Erase diskfile.bin for good
-  uint8_t null_block[BLOCK_SIZE] = {0};
-  for (int i = 0; i < BLOCK_SIZE / 2; i++)
-    disk.write(i, null_block);
-
-  // Initialize FAT
-  fat[ROOT_BLOCK] = FAT_EOF;
-  fat[FAT_BLOCK] = FAT_EOF;
+  cache.invalidate();
+  if (disk.resize(no_blocks) || disk.erase())
+    return -1;
 
-  // Rest of the blocks are marked as free
-  for (int i = 2; i < BLOCK_SIZE / 2; i++)
-    fat[i] = FAT_FREE;
+  // Write superblock
+  sb.magic = FS_MAGIC;
+  sb.version = FS_VERSION;
+  sb.block_size = block_size;
+  sb.no_blocks = no_blocks;
+  sb.fat_start = SUPER_BLOCK + 1;
+  sb.fat_blocks = fat_blocks;
+  sb.dedup_start = 0;
+  sb.dedup_entries = 0;
+  data_start = sb.fat_start + sb.fat_blocks;
+
+  uint8_t block[BLOCK_SIZE] = {0};
+  std::memcpy(block, &sb, sizeof(sb));
+  cache.write(SUPER_BLOCK, block);
+
+  // Initialize FAT, root, superblock and FAT blocks are reserved
+  fat.assign(no_blocks, FAT_FREE);
+  clearBlockMaps();
+  clearDirIndexes();
+  clearDentries();
+  inodes.clear();
+  frag_used.clear();
+  frag_partial.clear();
+  frags_loaded = false;
+  chain_refs.clear();
+  refs_loaded = false;
+  dedup_chains.clear();
+  dedup_hashes.clear();
+  dedup_loaded = false;
+  dedup_dirty = false;
+  // Descriptors on the old volume would find unrelated files on this one
+  open_files.clear();
+  for (unsigned i = 0; i < data_start; i++)
+    fat[i] = FAT_EOF;
+  fat_dirty.assign(sb.fat_blocks, true);
+  rebuildFreeMap();
 
   // Write entire FAT to disk
-  disk.write(FAT_BLOCK, (uint8_t *)fat);
+  writeFAT();
 
   // Create dir_entry for root directory
   std::string dir_name = "/";
   dir_entry dir_ent;
   std::strcpy(dir_ent.file_name, dir_name.c_str());
   dir_ent.size = 0;
-  dir_ent.first_blk = 0;
+  setFirstBlock(dir_ent, ROOT_BLOCK);
   dir_ent.type = TYPE_DIR;
   dir_ent.access_rights = READ | WRITE | EXECUTE;
 
-  // Add dir_entry first in root
-  working_directory[0] = dir_ent;
-
-  // Change dir_entry object to be empty
-  dir_name = "";
-  std::strcpy(dir_ent.file_name, dir_name.c_str());
-  dir_ent.type = TYPE_EMPTY;
-  dir_ent.access_rights = 0;
-
-  // Fill rest of root block with empty dir_entry
-  for (int i = 1; i < BLOCK_SIZE / 64; i++)
-  {
-    working_directory[i] = dir_ent;
-  }
-
-  // Write root block to disk
-  disk.write(ROOT_BLOCK, (uint8_t *)working_directory);
+  // Write root block with the dir_entry first
+  initDirBlock(ROOT_BLOCK, &dir_ent);
 
   return 0;
 }
@@ -84,10 +117,6 @@ int FS::create(std::string filepath)
   std::string new_filename = filepath_vec.back();
   filepath_vec.pop_back();
 
-  // Read cwd block and FAT block
-  disk.read(cwd, (uint8_t *)working_directory);
-  disk.read(FAT_BLOCK, (uint8_t *)fat);
-
   int current_block = findFirstFreeBlock();
   if (current_block == -1)
   {
@@ -95,34 +124,23 @@ int FS::create(std::string filepath)
     return -1;
   }
 
-  if (new_filename.length() >= 56)
+  if (new_filename.length() > maxNameLength())
   {
-    std::cout << "File name exceeds 55 character limit" << std::endl;
+    std::cout << "File name exceeds " << maxNameLength() << " character limit" << std::endl;
     return -1;
   }
 
   int temp_cwd = traverseToDir(filepath_vec);
-  if (temp_cwd == -1 || temp_cwd >= BLOCK_SIZE)
+  if (temp_cwd == -1 || temp_cwd >= sb.no_blocks)
   {
     std::cout << "Invalid path " << filepath << std::endl;
     return -1;
   }
 
-  bool full_dir = true;
-  for (auto &dir : working_directory)
-  {
-    if (dir.type != TYPE_EMPTY && dir.file_name == new_filename)
-    {
-      std::cout << new_filename << " already exists" << std::endl;
-      return -1;
-    }
-    else if (full_dir && dir.type == TYPE_EMPTY)
-      full_dir = false;
-  }
-
-  if (full_dir)
+  file_ref existing;
+  if (findEntry(temp_cwd, new_filename, existing) == 0)
   {
-    std::cout << "Full directory" << std::endl;
+    std::cout << new_filename << " already exists" << std::endl;
     return -1;
   }
 
@@ -138,12 +156,86 @@ int FS::create(std::string filepath)
   dir_entry dir_ent;
   std::strcpy(dir_ent.file_name, new_filename.c_str());
   dir_ent.size = 0;
-  dir_ent.first_blk = current_block;
+  setFirstBlock(dir_ent, current_block);
   dir_ent.type = TYPE_FILE;
   dir_ent.access_rights = READ | WRITE;
 
-  // Read user input
-  std::string line = "", data_str = "";
+  // Read user input, it is written IO_BATCH blocks at a time and the
+  // blocks are allocated as it comes so memory use does not grow with the
+  // size of the file. In compress mode the input is gathered a chunk at a
+  // time and the compressed chunks are written instead.
+  std::vector<uint8_t> data(IO_BATCH * BLOCK_SIZE);
+  size_t filled = 0;
+  int first_block = -1;
+  unsigned last_block = 0;
+  bool full = false;
+  uint64_t hash = FNV_OFFSET;
+
+  bool compressed = compress && sb.version != 1;
+  std::vector<uint8_t> chunk, compressed_chunk;
+  size_t chunk_filled = 0;
+  std::vector<uint32_t> chunks;
+  uint32_t written = 0;
+  if (compressed)
+  {
+    chunk.resize(CHUNK_SIZE);
+    compressed_chunk.resize(lz_bound(CHUNK_SIZE));
+    filled = written = sizeof(compress_header); // filled in at the end
+  }
+
+  // Links blocks for the first no_blocks blocks of data to the end of the
+  // chain and writes them
+  auto flush = [&](unsigned no_blocks)
+  {
+    if (dedup)
+      hash = hashBytes(data.data(), no_blocks * BLOCK_SIZE, hash);
+    std::vector<unsigned> blocks = allocateBlocks(no_blocks, first_block == -1 ? 0 : last_block + 1);
+    if (blocks.empty())
+      return -1;
+    if (first_block == -1)
+      first_block = blocks.front();
+    else
+      setFAT(last_block, blocks.front());
+    for (unsigned i = 0; i + 1 < blocks.size(); i++)
+      setFAT(blocks[i], blocks[i + 1]);
+    setFAT(blocks.back(), FAT_EOF);
+    last_block = blocks.back();
+    return cache.write_blocks(blocks, data.data());
+  };
+
+  // Adds length bytes to data, writing it whenever it is full
+  auto put = [&](const uint8_t *bytes, size_t length) -> int
+  {
+    for (size_t done = 0; done < length;)
+    {
+      size_t n = std::min(length - done, data.size() - filled);
+      std::memcpy(&data[filled], bytes + done, n);
+      filled += n;
+      done += n;
+      if (filled == data.size())
+      {
+        if (flush(IO_BATCH))
+          return -1;
+        filled = 0;
+      }
+    }
+    written += length;
+    return 0;
+  };
+
+  // Compresses the chunk gathered so far and adds it to data
+  auto putChunk = [&]() -> int
+  {
+    chunks.push_back(written);
+    size_t length = lz_compress(chunk.data(), chunk_filled, compressed_chunk.data());
+    size_t raw = chunk_filled;
+    chunk_filled = 0;
+    if (length >= raw)
+      return put(chunk.data(), raw);
+    return put(compressed_chunk.data(), length);
+  };
+
+  std::string line = "";
   while (std::getline(std::cin, line))
   {
     if (line.length() == 0)
@@ -151,70 +243,120 @@ int FS::create(std::string filepath)
       break;
     }
     line = line + "\n";
-    data_str += line;
+
+    // Out of space, the rest of the input is read but not kept
+    if (full || dir_ent.size + line.length() > UINT32_MAX)
+    {
+      full = true;
+      continue;
+    }
+
+    if (!compressed && put((const uint8_t *)line.data(), line.length()))
+      full = true;
+
+    for (size_t done = 0; compressed && done < line.length();)
+    {
+      size_t n = std::min(line.length() - done, CHUNK_SIZE - chunk_filled);
+      std::memcpy(&chunk[chunk_filled], &line[done], n);
+      chunk_filled += n;
+      done += n;
+      if (chunk_filled == CHUNK_SIZE && putChunk())
+      {
+        full = true;
+        break;
+      }
+    }
     dir_ent.size += line.length();
   }
 
-  // Check if filesize too big for number of free blocks
-  int no_free_blocks = getNoFreeBlocks();
-  if (!no_free_blocks || no_free_blocks < (dir_ent.size / BLOCK_SIZE))
+  if (!full && canPack(dir_ent))
   {
-    std::cout << "Not enough free blocks on disk" << std::endl;
-    return -1;
+    // Small file, keep it in a fragment
+    uint8_t *bytes = compressed ? chunk.data() : data.data();
+    size_t length = compressed ? chunk_filled : filled;
+    std::memset(bytes + length, 0, FRAG_SIZE - length);
+    if (allocateFragment(dir_ent) || writeFragment(dir_ent, bytes))
+      full = true;
   }
-
-  // Start writing to blocks
-  int size = data_str.length();
-
-  // Write FAT to disk
-  updateFAT(dir_ent.first_blk, size / BLOCK_SIZE + 1);
-
-  int index = 0;
-  int counter = 0;
-
-  // Write file data
-  while (current_block != FAT_EOF)
+  else if (!full)
   {
-    char block[BLOCK_SIZE] = {0};
-    index = counter * BLOCK_SIZE;
-
-    if (fat[current_block] != FAT_EOF)
+    // The last chunk and the chunk index, the header goes first in data if
+    // the first block is not written yet
+    compress_header header = {0, 0, CHUNK_SIZE, 0};
+    if (compressed)
     {
-      for (int j = 0; j < BLOCK_SIZE; j++)
-        block[j] = data_str[index + j];
+      if (chunk_filled && putChunk())
+        full = true;
+      chunks.push_back(written);
+      header.chunks = chunks.size() - 1;
+      header.index_start = written;
+      if (!full && put((const uint8_t *)chunks.data(), chunks.size() * sizeof(uint32_t)))
+        full = true;
+      if (first_block == -1)
+        std::memcpy(data.data(), &header, sizeof(header));
+      dir_ent.access_rights |= FLAG_COMPRESSED;
     }
-    else
+
+    // The last block is written even if it is empty, a file has
+    // size / BLOCK_SIZE + 1 blocks
+    bool header_in_data = first_block == -1;
+    unsigned no_blocks = filled / BLOCK_SIZE + 1;
+    std::memset(&data[filled], 0, no_blocks * BLOCK_SIZE - filled);
+    if (full || flush(no_blocks))
+      full = true;
+    else if (compressed && !header_in_data)
     {
-      for (int j = 0; j < size % BLOCK_SIZE; j++)
-        block[j] = data_str[index + j];
+      uint8_t block[BLOCK_SIZE];
+      if (cache.read(first_block, block))
+        full = true;
+      else
+      {
+        std::memcpy(block, &header, sizeof(header));
+        if (cache.write(first_block, block))
+          full = true;
+      }
     }
+    setFirstBlock(dir_ent, first_block);
+  }
 
-    disk.write(current_block, (uint8_t *)block);
-    current_block = fat[current_block];
-    counter++;
+  // Give back the blocks written so far
+  if (full)
+  {
+    if (first_block != -1)
+      freeChain(first_block);
+    writeFAT();
+    std::cout << "Not enough free blocks on disk" << std::endl;
+    return -1;
   }
 
+  // Share the chain of a file with the same content if there is one
+  if (dedup && !isPacked(dir_ent))
+    dedupFile(dir_ent, hash);
+
   // Write to cwd block
-  createDirEntry(&dir_ent, temp_cwd);
+  if (addEntry(temp_cwd, dir_ent))
+  {
+    freeData(dir_ent);
+    writeFAT();
+    std::cout << "Full directory" << std::endl;
+    return -1;
+  }
+
+  writeFAT();
 
   return 0;
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
-int FS::cat(std::string filepath)
+// cat <filepath> reads the content of a file and writes it to out, the
+// screen by default
+int FS::cat(std::string filepath, std::ostream &out)
 {
-  // Read working directory block and FAT
-  disk.read(cwd, (uint8_t *)working_directory);
-  disk.read(FAT_BLOCK, (uint8_t *)fat);
-
   // Go to directory
   std::vector<std::string> filepath_vec = interpretFilepath(filepath);
   std::string file = filepath_vec.back();
   filepath_vec.pop_back();
 
-  int temp_cwd = cwd;
-  if (filepath_vec.size())
-    temp_cwd = traverseToDir(filepath_vec);
+  int temp_cwd = traverseToDir(filepath_vec);
 
   if (temp_cwd == -1)
   {
@@ -223,62 +365,80 @@ int FS::cat(std::string filepath)
   }
 
   // Find file
-  bool found_dir = false;
-  int current_block, size;
-  for (auto &dir : working_directory)
+  file_ref ref;
+  if (findEntry(temp_cwd, file, ref) || (ref.entry.type != TYPE_FILE && ref.entry.type != TYPE_DIR))
   {
-    if (dir.file_name == file && dir.type == TYPE_FILE)
-    {
-      if ((dir.access_rights & READ) != READ)
-      {
-        std::cout << "File " << file << " does not have read permission" << std::endl;
-        return -1;
-      }
+    std::cout << "File " << file << " does not exist." << std::endl;
+    return -1;
+  }
 
-      current_block = dir.first_blk;
-      size = dir.size;
-      found_dir = true;
-      break;
-    }
-    else if (dir.file_name == file && dir.type == TYPE_DIR)
-    {
-      std::cout << file << " is a directory" << std::endl;
-      return -1;
-    }
+  if (ref.entry.type == TYPE_DIR)
+  {
+    std::cout << file << " is a directory" << std::endl;
+    return -1;
   }
 
-  if (!found_dir)
+  if ((ref.entry.access_rights & READ) != READ)
   {
-    std::cout << "File " << file << " does not exist." << std::endl;
+    std::cout << "File " << file << " does not have read permission" << std::endl;
     return -1;
   }
 
-  uint8_t char_array[BLOCK_SIZE];
-  std::string to_print = "";
+  int current_block = getFirstBlock(ref.entry);
+  uint32_t size = ref.entry.size;
 
-  // Read blocks
-  do
+  if (isPacked(ref.entry))
   {
-    memset(char_array, 0, BLOCK_SIZE);
-    disk.read(current_block, char_array);
-    if (fat[current_block] != FAT_EOF)
-    {
+    uint8_t fragment[FRAG_SIZE];
+    if (readFragment(ref.entry, fragment))
+      return -1;
+    out.write((const char *)fragment, size);
+    return 0;
+  }
 
-      for (int i = 0; i < BLOCK_SIZE; i++)
-      {
-        std::cout << char_array[i];
-      }
-    }
-    else
+  if (isCompressed(ref.entry))
+  {
+    // Decompressed and written a chunk at a time
+    std::vector<uint32_t> chunks;
+    std::vector<uint8_t> chunk(CHUNK_SIZE);
+    if (loadChunks(ref.entry, chunks))
+      return -1;
+    for (unsigned i = 0; i + 1 < chunks.size(); i++)
     {
-      for (int i = 0; i < size % BLOCK_SIZE; i++)
-      {
-        std::cout << char_array[i];
-      }
+      int length = readChunk(ref.entry, chunks, i, chunk.data());
+      if (length < 0)
+        return -1;
+      out.write((const char *)chunk.data(), length);
     }
+    return 0;
+  }
+
+  const std::vector<unsigned> &chain = getBlockMap(current_block);
+  std::vector<uint8_t> char_array(IO_BATCH * BLOCK_SIZE);
+
+  // Read blocks IO_BATCH blocks at a time, each batch is written to out in
+  // one call and cut at the end of the file
+  uint32_t left = size;
+  for (unsigned i = 0; i < chain.size() && left > 0; i += IO_BATCH)
+  {
+    std::vector<unsigned> batch(chain.begin() + i, chain.begin() + std::min<size_t>(i + IO_BATCH, chain.size()));
+    if (cache.read_blocks(batch, char_array.data()))
+      return -1;
+
+    size_t length = std::min<size_t>(left, batch.size() * BLOCK_SIZE);
+    out.write((const char *)char_array.data(), length);
+    left -= length;
+  }
 
-    current_block = fat[current_block];
-  } while (current_block != FAT_EOF);
+  // What is left of a sparse file is its hole, written as zeros without
+  // reading anything
+  std::fill(char_array.begin(), char_array.end(), 0);
+  while (left > 0)
+  {
+    size_t length = std::min<size_t>(left, char_array.size());
+    out.write((const char *)char_array.data(), length);
+    left -= length;
+  }
 
   return 0;
 }
@@ -286,16 +446,17 @@ int FS::cat(std::string filepath)
 // ls lists the content in the currect directory (files and sub-directories)
 int FS::ls()
 {
-  // Read working directory block
-  disk.read(cwd, (uint8_t *)working_directory);
+  std::vector<file_stat> entries;
+  if (readdir(".", entries))
+    return -1;
 
   // Get longest filename
   int dir_name_width = 4; // at least length of "name"
-  for (auto &dir : working_directory)
+  for (auto &st : entries)
   {
-    if (dir.type != TYPE_EMPTY && std::string(dir.file_name).length() > dir_name_width)
+    if (st.name.length() > dir_name_width)
     {
-      dir_name_width = std::string(dir.file_name).length();
+      dir_name_width = st.name.length();
     }
   }
   dir_name_width += 2;
@@ -306,43 +467,127 @@ int FS::ls()
   std::cout << std::left << std::setw(14) << std::setfill(' ') << "accessrights";
   std::cout << std::left << std::setw(10) << std::setfill(' ') << "size" << std::endl;
 
-  for (auto &dir : working_directory)
+  for (auto &st : entries)
+  {
+    std::string rwx = accessRightsToString(st.access_rights);
+    std::string type = "";
+
+    if (st.type == TYPE_DIR)
+      type = "dir";
+    else if (st.type == TYPE_FILE)
+      type = "file";
+    std::cout << std::left << std::setw(dir_name_width) << std::setfill(' ') << st.name;
+    std::cout << std::left << std::setw(6) << std::setfill(' ') << type;
+    std::cout << std::left << std::setw(14) << std::setfill(' ') << rwx;
+
+    if (st.type == TYPE_DIR)
+      std::cout << std::left << std::setw(10) << std::setfill(' ') << "-" << std::endl;
+    else if (st.type == TYPE_FILE)
+      std::cout << std::left << std::setw(10) << std::setfill(' ') << st.size << std::endl;
+  }
+  std::cout << std::endl;
+  return 0;
+}
+
+// readdir fills entries with the content of the directory <dirpath>,
+// the parent is named ".." also in the root directory
+int FS::readdir(std::string dirpath, std::vector<file_stat> &entries)
+{
+  int dir_block = cwd;
+  if (interpretFilepath(dirpath).size())
   {
-    if (dir.type != TYPE_EMPTY)
+    file_stat st;
+    if (stat(dirpath, st))
+      return -1;
+    if (st.type != TYPE_DIR)
     {
+      std::cout << dirpath << " is not a directory" << std::endl;
+      return -1;
+    }
+    dir_block = st.first_blk;
+  }
+
+  entries.clear();
+  std::vector<file_ref> refs;
+  if (listDir(dir_block, refs))
+    return -1;
+  for (auto &ref : refs)
+  {
+    entries.push_back(toStat(ref.entry));
+    if (ref.dir_block == (unsigned)dir_block && ref.index == 0)
+      entries.back().name = "..";
+  }
+  return 0;
+}
 
-      std::string rwx = accessRightsToString(dir.access_rights);
-      std::string type = "";
+// stat fills st with the name, size, type and access rights of <filepath>
+int FS::stat(std::string filepath, file_stat &st)
+{
+  std::vector<std::string> filepath_vec = interpretFilepath(filepath);
+  std::string name = filepath_vec.size() ? filepath_vec.back() : ".";
+  if (filepath_vec.size())
+    filepath_vec.pop_back();
 
-      if (dir.type == TYPE_DIR)
-        type = "dir";
-      else if (dir.type == TYPE_FILE)
-        type = "file";
-      if (std::string(dir.file_name) == "/")
-        std::cout << std::left << std::setw(dir_name_width) << std::setfill(' ') << "..";
-      else
-        std::cout << std::left << std::setw(dir_name_width) << std::setfill(' ') << std::string(dir.file_name);
-      std::cout << std::left << std::setw(6) << std::setfill(' ') << type;
-      std::cout << std::left << std::setw(14) << std::setfill(' ') << rwx;
-
-      if (dir.type == TYPE_DIR)
-        std::cout << std::left << std::setw(10) << std::setfill(' ') << "-" << std::endl;
-      else if (dir.type == TYPE_FILE)
-        std::cout << std::left << std::setw(10) << std::setfill(' ') << dir.size << std::endl;
+  int temp_cwd = traverseToDir(filepath_vec);
+  if (temp_cwd == -1)
+  {
+    std::cout << "Invalid path " << filepath << std::endl;
+    return -1;
+  }
+
+  file_ref ref;
+  if (name != "." && name != ".." && name != "/")
+  {
+    if (findEntry(temp_cwd, name, ref))
+    {
+      std::cout << filepath << " does not exist" << std::endl;
+      return -1;
     }
+    st = toStat(ref.entry);
+    return 0;
   }
-  std::cout << std::endl;
+
+  // A directory named by its position, it is described by its inode
+  int dir_block = temp_cwd;
+  if (name == "/")
+    dir_block = ROOT_BLOCK;
+  else if (name == "..")
+    dir_block = getParent(temp_cwd);
+
+  inode *node = dir_block == -1 ? nullptr : getInode(dir_block);
+  if (!node)
+  {
+    std::cout << filepath << " does not exist" << std::endl;
+    return -1;
+  }
+  st.name = node->name;
+  st.size = 0;
+  st.first_blk = dir_block;
+  st.type = TYPE_DIR;
+  st.access_rights = node->access_rights;
+  return 0;
+}
+
+// stat <filepath> prints what stat returns for <filepath>
+int FS::printStat(std::string filepath)
+{
+  file_stat st;
+  if (stat(filepath, st))
+    return -1;
+
+  std::cout << "name:         " << st.name << std::endl;
+  std::cout << "type:         " << (st.type == TYPE_DIR ? "dir" : "file") << std::endl;
+  std::cout << "accessrights: " << accessRightsToString(st.access_rights) << std::endl;
+  std::cout << "size:         " << st.size << std::endl;
+  std::cout << "first block:  " << st.first_blk << std::endl;
   return 0;
 }
 
 // cp <sourcepath> <destpath> makes an exact copy of the file
-// <sourcepath> to a new file <destpath>
+// <sourcepath> to a new file <destpath>. On v2 volumes the copy shares the
+// blocks of the source until one of them is written.
 int FS::cp(std::string sourcepath, std::string destpath)
 {
-  // Read working directory block and FAT from disk
-  disk.read(cwd, (uint8_t *)working_directory);
-  disk.read(FAT_BLOCK, (uint8_t *)fat);
-
   std::vector<std::string> source_vec = interpretFilepath(sourcepath);
   std::vector<std::string> dest_vec = interpretFilepath(destpath);
 
@@ -352,95 +597,61 @@ int FS::cp(std::string sourcepath, std::string destpath)
   std::string destination = dest_vec.back();
   dest_vec.pop_back();
 
-  if (destination.length() >= 56) {
-    std::cout << "Filename " << destination << " exceeds 55 characters" << std::endl;
+  if (destination.length() > maxNameLength()) {
+    std::cout << "Filename " << destination << " exceeds " << maxNameLength() << " characters" << std::endl;
     return -1;
   }
 
   int temp_cwd = traverseToDir(source_vec); // traverseToDir returns cwd if empty input vector
 
   // Find sourcepath, make sure destpath doesn't exist
-  bool found_source_dir = false, found_dest_dir = false;
-  uint32_t size;
-  uint16_t source_block;
-  uint8_t type, access_rights;
-
-  for (auto &dir : working_directory)
-  {
-    if (dir.file_name == source)
-    {
-      if ((dir.access_rights & READ) != READ)
-      {
-        std::cout << "Missing read permission on " << source << std::endl;
-        return -1;
-      }
-
-      source_block = dir.first_blk;
-      size = dir.size;
-      type = dir.type;
-      access_rights = dir.access_rights;
-      found_source_dir = true;
-    }
-  }
-
-  if (!found_source_dir)
+  file_ref source_ref;
+  if (temp_cwd == -1 || findEntry(temp_cwd, source, source_ref))
   {
     std::cout << sourcepath << " does not exist" << std::endl;
     return -1;
   }
 
-  if (dest_vec.size())
+  if ((source_ref.entry.access_rights & READ) != READ)
   {
-    temp_cwd = traverseToDir(dest_vec);
+    std::cout << "Missing read permission on " << source << std::endl;
+    return -1;
   }
-  else // If source had a path but dest should be in original cwd
+
+  uint32_t size = source_ref.entry.size;
+  unsigned source_block = getFirstBlock(source_ref.entry);
+
+  temp_cwd = traverseToDir(dest_vec);
+  if (temp_cwd == -1)
   {
-    disk.read(cwd, (uint8_t *)working_directory);
-    temp_cwd = cwd;
+    std::cout << "Invalid path " << destpath << std::endl;
+    return -1;
   }
 
   // What if destination is a directory?
-  bool is_dir = false;
-  for (auto &dir : working_directory)
+  file_ref dest_ref;
+  if (findEntry(temp_cwd, destination, dest_ref) == 0)
   {
-    if (dir.file_name == destination && dir.type != TYPE_EMPTY)
+    if (dest_ref.entry.type != TYPE_DIR) // If destpath is found, and it's not a directory, cannot copy.
     {
-      found_dest_dir = true;
-      if (dir.type == TYPE_DIR)
-      {
-        if ((dir.access_rights & WRITE) != WRITE)
-        {
-          std::cout << "Missing write permission on " << destination << std::endl;
-          return -1;
-        }
-
-        temp_cwd = dir.first_blk;
-        destination = source;
-        is_dir = true;
-      }
-      break;
+      std::cout << "File " << destpath << " already exists" << std::endl;
+      return -1;
     }
-  }
-
-  if (found_dest_dir && !is_dir) // If destpath is found, and it's not a directory, cannot copy.
-  {
-    std::cout << "File " << destpath << " already exists" << std::endl;
-    return -1;
-  }
 
-  // Check if source filename already exists in destination dir
-  disk.read(temp_cwd, (uint8_t *)working_directory);
-  for (auto &dir: working_directory) {
-    if (dir.file_name == source) {
-      std::cout << source << " already exists" << std::endl;
+    if ((dest_ref.entry.access_rights & WRITE) != WRITE)
+    {
+      std::cout << "Missing write permission on " << destination << std::endl;
       return -1;
     }
+
+    temp_cwd = getFirstBlock(dest_ref.entry);
+    destination = source;
   }
 
-  int no_free = getNoFreeBlocks();
-  if (no_free < size / BLOCK_SIZE)
+  // Check if source filename already exists in destination dir
+  if (findEntry(temp_cwd, source, dest_ref) == 0)
   {
-    std::cout << "Not enough free blocks on disk" << std::endl;
+    std::cout << source << " already exists" << std::endl;
     return -1;
   }
 
@@ -448,32 +659,70 @@ int FS::cp(std::string sourcepath, std::string destpath)
   dir_entry dir_ent;
   std::strcpy(dir_ent.file_name, destination.c_str());
   dir_ent.size = size;
-  dir_ent.type = type;
-  dir_ent.access_rights = access_rights;
+  dir_ent.type = source_ref.entry.type;
+  dir_ent.access_rights = getRights(source_ref.entry);
+  if (isCompressed(source_ref.entry))
+    dir_ent.access_rights |= FLAG_COMPRESSED; // the chain is shared or copied as it is
 
-  int block_no = findFirstFreeBlock();
-  dir_ent.first_blk = block_no;
+  if (canPack(dir_ent))
+  {
+    // The copy goes in a fragment, the source fits in a fragment or in the
+    // first block of its chain
+    uint8_t data[BLOCK_SIZE];
+    if (isPacked(source_ref.entry))
+      readFragment(source_ref.entry, data);
+    else
+      cache.read(source_block, data);
+    std::memset(data + size, 0, FRAG_SIZE - size);
 
-  // Write to destpath
-  createDirEntry(&dir_ent, temp_cwd);
+    if (allocateFragment(dir_ent) || writeFragment(dir_ent, data))
+    {
+      std::cout << "Not enough free blocks on disk" << std::endl;
+      return -1;
+    }
+    if (addEntry(temp_cwd, dir_ent))
+    {
+      freeData(dir_ent);
+      writeFAT();
+      std::cout << "Full directory" << std::endl;
+      return -1;
+    }
+    writeFAT();
+    return 0;
+  }
 
-  // Write to FAT
-  updateFAT(block_no, size / BLOCK_SIZE + 1);
+  if (sb.version != 1 && dir_ent.type == TYPE_FILE)
+  {
+    // Copy on write, the copy shares the chain of the source until one
+    // of them is written
+    setFirstBlock(dir_ent, source_block);
+    refChain(source_block);
+    if (addEntry(temp_cwd, dir_ent))
+    {
+      unrefChain(source_block);
+      std::cout << "Full directory" << std::endl;
+      return -1;
+    }
+    return 0;
+  }
 
-  // Copy data from sourcepath to destpath
-  uint16_t dest_block = dir_ent.first_blk;
-  char block[BLOCK_SIZE] = {0};
+  // Copy data from sourcepath to a new chain
+  int block_no = copyChain(source_block);
+  if (block_no == -1)
+    return -1;
+  setFirstBlock(dir_ent, block_no);
 
-  while (true)
+  // Write to destpath
+  if (addEntry(temp_cwd, dir_ent))
   {
-    disk.read(source_block, (uint8_t *)block); // read source block
-    disk.write(dest_block, (uint8_t *)block);  // write dest block
-    if (fat[source_block] == FAT_EOF || fat[dest_block] == FAT_EOF)
-      break;
-    dest_block = fat[dest_block];
-    source_block = fat[source_block];
+    freeChain(block_no);
+    writeFAT();
+    std::cout << "Full directory" << std::endl;
+    return -1;
   }
 
+  writeFAT();
+
   return 0;
 }
 
@@ -481,9 +730,6 @@ int FS::cp(std::string sourcepath, std::string destpath)
 //  or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
 int FS::mv(std::string sourcepath, std::string destpath)
 {
-  // Read working directory block
-  disk.read(cwd, (uint8_t *)working_directory);
-
   std::vector<std::string> source_vec = interpretFilepath(sourcepath);
   std::vector<std::string> dest_vec = interpretFilepath(destpath);
 
@@ -493,8 +739,8 @@ int FS::mv(std::string sourcepath, std::string destpath)
   std::string destination = dest_vec.back();
   dest_vec.pop_back();
 
-  if (destination.length() >= 56) {
-    std::cout << "Filename " << destination << " exceeds 55 characters" << std::endl;
+  if (destination.length() > maxNameLength()) {
+    std::cout << "Filename " << destination << " exceeds " << maxNameLength() << " characters" << std::endl;
     return -1;
   }
 
@@ -525,104 +771,80 @@ int FS::mv(std::string sourcepath, std::string destpath)
     return -1;
   }
 
-  disk.read(source_cwd, (uint8_t *)working_directory);
-
-  bool found_dest_dir = false, source_found = false;
-  for (auto &source_dir : working_directory)
+  // Find source in the source directory
+  file_ref source_ref;
+  if (findEntry(source_cwd, source, source_ref))
   {
-    // Find source_dir in the source working Directory
-    if (std::string(source_dir.file_name) == source && source_dir.type != TYPE_EMPTY)
-    {
-      source_found = true;
-      // Save source_dir temporary while reading the destination working directory
-      dir_entry temp_source = source_dir;
-      disk.read(dest_cwd, (uint8_t *)working_directory);
-
-      // Find the dest_dir in the destination working directory
-      for (auto &dest_dir : working_directory)
-      {
-
-        // Case: If file or directory already exist in the destination directory
-        if (std::string(dest_dir.file_name) == destination && dest_dir.type != TYPE_EMPTY)
-        {
-          found_dest_dir = true;
-
-          if (dest_dir.type == TYPE_DIR) // Case: If dir_entry is a directory, move source inside.
-          {
-            // Save the block number of directory before reading it to the working_directory.
-            int temp_blk = dest_dir.first_blk;
-            disk.read(temp_blk, (uint8_t *)working_directory);
+    std::cout << "Source not found" << std::endl;
+    return -1;
+  }
 
-            // Search for file or directory in destination with the same name
-            for (auto &dir : working_directory)
-              if (dir.file_name == source && dir.type != TYPE_EMPTY)
-              {
-                std::cout << source << " already exists in destination" << std::endl;
-                return -1;
-              }
+  dir_entry moved = source_ref.entry;
+  unsigned target_dir;
+  file_ref dest_ref;
 
-            // If passed loop, no identical filenames, create a new dir_entry in destination, copy of source
-            createDirEntry(&temp_source, temp_blk);
-
-            // Change source to empty, and write to disk
-            disk.read(source_cwd, (uint8_t *)working_directory);
-            source_dir.type = TYPE_EMPTY;
-            disk.write(source_cwd, (uint8_t *)working_directory);
-
-            break;
-          }
-          else // Case: If dir_entry is file, destination already exists, abort.
-          {
-            std::cout << "File " << destination << " already exists." << std::endl;
-            return -1;
-          }
-        }
-        // If reaching end of this loop: no file or directory named 'destination' in the dest_cwd.
-      }
+  if (findEntry(dest_cwd, destination, dest_ref) == 0)
+  {
+    // Case: If dir_entry is file, destination already exists, abort.
+    if (dest_ref.entry.type != TYPE_DIR)
+    {
+      std::cout << "File " << destination << " already exists." << std::endl;
+      return -1;
+    }
 
-      // Case: No destination found in dest_cwd, and only one argument. Same directory - change the name of source to dest.
-      if (!found_dest_dir && destination != "/" && !dest_vec.size())
-      {
-        // Change source filename to destination
-        if (destination != "..")
-        {
-          disk.read(source_cwd, (uint8_t *)working_directory);
-          std::strcpy(source_dir.file_name, destination.c_str());
-          disk.write(source_cwd, (uint8_t *)working_directory);
-        }
-      }
-      else if (!found_dest_dir && destination != "/") // Case: No destination found in dest_cwd, but more than one argument - mv to another dir and change name.
-      {
-        // Move to destination dir and change name.
-        if (destination != "..")
-          std::strcpy(temp_source.file_name, destination.c_str());
-        createDirEntry(&temp_source, dest_cwd);
-
-        // Set source to empty
-        disk.read(source_cwd, (uint8_t *)working_directory);
-        source_dir.type = TYPE_EMPTY;
-        disk.write(source_cwd, (uint8_t *)working_directory);
-      }
-      break;
+    // Case: If dir_entry is a directory, move source inside.
+    target_dir = getFirstBlock(dest_ref.entry);
+    if (findEntry(target_dir, source, dest_ref) == 0)
+    {
+      std::cout << source << " already exists in destination" << std::endl;
+      return -1;
     }
   }
-
-  if (!source_found)
+  else
   {
-    std::cout << "Source not found" << std::endl;
-    return -1;
+    // Case: No destination found in dest_cwd, move source there and change its name
+    target_dir = dest_cwd;
+    if (destination != "..")
+      std::strcpy(moved.file_name, destination.c_str());
   }
 
-  return 0;
+  if (target_dir == source_cwd)
+  {
+    // Same directory - change the name of source to dest in place
+    file_ref old_ref = source_ref;
+    source_ref.entry = moved;
+    updateEntry(source_ref);
+    moveOpenFiles(old_ref, &source_ref);
+  }
+  else
+  {
+    if (addEntry(target_dir, moved))
+    {
+      writeFAT();
+      std::cout << "Full directory" << std::endl;
+      return -1;
+    }
+    removeEntry(source_ref);
+    if (findEntry(target_dir, getName(moved), dest_ref) == 0)
+      moveOpenFiles(source_ref, &dest_ref);
+
+    // A moved directory gets a new parent
+    file_ref parent_ref;
+    if (moved.type == TYPE_DIR && findEntry(getFirstBlock(moved), "..", parent_ref) == 0)
+    {
+      setFirstBlock(parent_ref.entry, target_dir);
+      updateEntry(parent_ref);
+    }
+  }
+
+  writeFAT();
+
+  return 0;
 }
 
 // rm <filepath> removes / deletes the file <filepath>
 int FS::rm(std::string filepath)
 {
-  // Read working directory block and FAT
-  disk.read(cwd, (uint8_t *)working_directory);
-  disk.read(FAT_BLOCK, (uint8_t *)fat);
-
   std::vector<std::string> path_vec = interpretFilepath(filepath);
   std::string file = path_vec.back();
   path_vec.pop_back();
@@ -645,72 +867,52 @@ int FS::rm(std::string filepath)
   }
 
   // Find filepath
-  bool found_dir = false, found_file = false;
-  int current_block, next_block;
+  file_ref ref;
+  if (findEntry(temp_cwd, file, ref) || (ref.entry.type != TYPE_FILE && ref.entry.type != TYPE_DIR))
+  {
+    std::cout << filepath << " does not exist" << std::endl;
+    return -1;
+  }
 
-  for (auto &dir : working_directory)
+  unsigned current_block = getFirstBlock(ref.entry);
+  if (ref.entry.type == TYPE_DIR)
   {
-    if (dir.file_name == file && dir.type == TYPE_FILE)
+    // Check that user isn't trying to remove cwd
+    if (current_block == cwd)
     {
-      // Mark dir_entry as empty
-      dir.type = TYPE_EMPTY;
-      current_block = dir.first_blk;
-      found_file = true;
-      break;
+      std::cout << "Cannot remove current working directory" << std::endl;
+      return -1;
     }
-    else if (dir.file_name == file && dir.type == TYPE_DIR)
-    {
-      // Check that user isn't trying to remove cwd
-      if (dir.first_blk == cwd)
-      {
-        std::cout << "Cannot remove current working directory" << std::endl;
-        return -1;
-      }
 
-      // Check that directory doesn't have any files/directories
-      disk.read(dir.first_blk, (uint8_t *)working_directory);
-      for (auto &dir2 : working_directory)
-      {
-        if (dir2.type != TYPE_EMPTY && std::string(dir2.file_name) != "..")
-        {
-          if (std::string(dir2.file_name) == "/")
-          {
-            std::cout << "Cannot remove root directory" << std::endl;
-            return -1;
-          }
-          std::cout << "Directory " << filepath << " is not empty" << std::endl;
-          return -1;
-        }
-      }
-      disk.read(temp_cwd, (uint8_t *)working_directory);
-
-      // Mark dir_entry as empty
-      dir.type = TYPE_EMPTY;
-      current_block = dir.first_blk;
-      found_dir = true;
-      break;
+    if (current_block == ROOT_BLOCK)
+    {
+      std::cout << "Cannot remove root directory" << std::endl;
+      return -1;
     }
-  }
 
-  if (!found_dir && !found_file)
-  {
-    std::cout << filepath << " does not exist" << std::endl;
-    return -1;
+    // Check that directory doesn't have any files/directories besides ".."
+    dir_index *index = getDirIndex(current_block);
+    if (!index)
+      return -1;
+    if (index->names.size() > 1)
+    {
+      std::cout << "Directory " << filepath << " is not empty" << std::endl;
+      return -1;
+    }
+    dropDirIndex(current_block);
+    dropDentries(current_block);
   }
 
-  // Write to working directory
-  disk.write(temp_cwd, (uint8_t *)working_directory);
+  // Free FAT entries, while the entry is still there for the counts of
+  // shared chains and fragments to be built from
+  freeData(ref.entry);
 
-  // Free FAT entries
-  do
-  {
-    next_block = fat[current_block];
-    fat[current_block] = FAT_FREE;
-    current_block = next_block;
-  } while (current_block != FAT_EOF);
+  // Mark dir_entry as empty
+  removeEntry(ref);
+  moveOpenFiles(ref, nullptr);
 
   // Write to FAT
-  disk.write(FAT_BLOCK, (uint8_t *)fat);
+  writeFAT();
 
   return 0;
 }
@@ -719,13 +921,6 @@ int FS::rm(std::string filepath)
 // the end of file <filepath2>. The file <filepath1> is unchanged.
 int FS::append(std::string filepath1, std::string filepath2)
 {
-  // TODO: append mellan två stora filer (mer än ett block) och append mellan två mindre
-  // filer som tillsammans blir en stor fil, ger inte korrekt output när man kör cat.
-
-  // Read working directory block and FAT
-  disk.read(cwd, (uint8_t *)working_directory);
-  disk.read(FAT_BLOCK, (uint8_t *)fat);
-
   std::vector<std::string> file1_vec = interpretFilepath(filepath1);
   std::vector<std::string> file2_vec = interpretFilepath(filepath2);
 
@@ -736,8 +931,10 @@ int FS::append(std::string filepath1, std::string filepath2)
   file2_vec.pop_back();
 
   // Search for filepaths, exit if not found
-  int filepath1_block, filepath2_block, size1, size2;
+  int filepath1_block, filepath2_block;
+  uint32_t size1, size2;
   int no_found = 0;
+  file_ref ref1, ref2;
 
   int temp_cwd = traverseToDir(file1_vec);
 
@@ -747,29 +944,24 @@ int FS::append(std::string filepath1, std::string filepath2)
     return -1;
   }
 
-  for (auto &dir : working_directory)
+  if (findEntry(temp_cwd, file1, ref1) == 0)
   {
-    if (std::string(dir.file_name) == file1 && dir.type != TYPE_EMPTY)
+    if (ref1.entry.type == TYPE_DIR)
     {
-      if (dir.type == TYPE_DIR)
-      {
-        std::cout << file1 << " is a directory" << std::endl;
-        return -1;
-      }
-
-      if ((dir.access_rights & READ) != READ)
-      {
-        std::cout << file1 << " does not have read permission" << std::endl;
-        return -1;
-      }
+      std::cout << file1 << " is a directory" << std::endl;
+      return -1;
+    }
 
-      filepath1_block = dir.first_blk;
-      size1 = dir.size;
-      no_found++;
+    if ((ref1.entry.access_rights & READ) != READ)
+    {
+      std::cout << file1 << " does not have read permission" << std::endl;
+      return -1;
     }
-  }
 
-  disk.read(cwd, (uint8_t *)working_directory);
+    filepath1_block = getFirstBlock(ref1.entry);
+    size1 = ref1.entry.size;
+    no_found++;
+  }
 
   temp_cwd = traverseToDir(file2_vec);
 
@@ -779,31 +971,34 @@ int FS::append(std::string filepath1, std::string filepath2)
     return -1;
   }
 
-  for (auto &dir : working_directory)
+  if (findEntry(temp_cwd, file2, ref2) == 0)
   {
-    if (std::string(dir.file_name) == file2 && dir.type != TYPE_EMPTY)
+    if (ref2.entry.type == TYPE_DIR)
     {
-      if (dir.type == TYPE_DIR)
-      {
-        std::cout << file2 << " is a directory" << std::endl;
-        return -1;
-      }
-
-      if ((dir.access_rights & WRITE) != WRITE)
-      {
-        std::cout << file2 << " does not have write permission" << std::endl;
-        return -1;
-      }
+      std::cout << file2 << " is a directory" << std::endl;
+      return -1;
+    }
 
-      filepath2_block = dir.first_blk;
-      size2 = dir.size;
-      no_found++;
+    if ((ref2.entry.access_rights & WRITE) != WRITE)
+    {
+      std::cout << file2 << " does not have write permission" << std::endl;
+      return -1;
     }
+
+    filepath2_block = getFirstBlock(ref2.entry);
+    size2 = ref2.entry.size;
+    no_found++;
   }
 
   if (no_found != 2) // Expecting exactly two files found.
     return -1;
 
+  if ((uint64_t)size1 + size2 > UINT32_MAX)
+  {
+    std::cout << "File too large" << std::endl;
+    return -1;
+  }
+
   // Check if enough free blocks
   int no_free_blocks = getNoFreeBlocks();
   if (no_free_blocks < size1 / BLOCK_SIZE + 1)
@@ -812,70 +1007,147 @@ int FS::append(std::string filepath1, std::string filepath2)
     return -1;
   }
 
-  // Find end of filepath2
-  while (fat[filepath2_block] != FAT_EOF)
-    filepath2_block = fat[filepath2_block];
-
-  // Update FAT entries for filepath2
-  if (size1 + size2 > BLOCK_SIZE)
-    updateFAT(filepath2_block, size1 / BLOCK_SIZE + (size1 % BLOCK_SIZE + size2 % BLOCK_SIZE) / BLOCK_SIZE);
-
-  // Read filepath1 data
-  char block[BLOCK_SIZE] = {0};
-  std::string filepath1_data = "";
-  int current_block = filepath1_block;
+  // A packed filepath1 is read before anything is written, it could be
+  // filepath2 itself
+  std::vector<uint8_t> source(IO_BATCH * BLOCK_SIZE);
+  if (isPacked(ref1.entry) && readFragment(ref1.entry, source.data()))
+    return -1;
 
-  while (current_block != FAT_EOF)
+  if (isPacked(ref2.entry) && size1 + size2 <= FRAG_SIZE)
   {
-    disk.read(current_block, (uint8_t *)block);
-    filepath1_data.append(block);
-
-    current_block = fat[current_block];
+    // Both fit in the fragment of filepath2
+    uint8_t fragment[FRAG_SIZE];
+    if (readFragment(ref2.entry, fragment) ||
+        (!isPacked(ref1.entry) && cache.read(filepath1_block, source.data())))
+      return -1;
+    std::memcpy(fragment + size2, source.data(), size1);
+    if (writeFragment(ref2.entry, fragment))
+      return -1;
   }
-
-  // Write data to the end of filepath2
-  int data_index = 0, first_iteration = 1;
-  while (data_index < size1)
+  else
   {
-    // Write one block at a time
-    if (first_iteration)
+    // The hole of a sparse filepath2 is filled, the data goes after it
+    if (detachFile(ref2) || fillHole(ref2, size2 / BLOCK_SIZE + 1))
+      return -1;
+
+    // Appending a file to itself, it may have moved to a new chain
+    if (ref1.dir_block == ref2.dir_block && ref1.index == ref2.index)
+    {
+      ref1.entry = ref2.entry;
+      filepath1_block = getFirstBlock(ref1.entry);
+    }
+
+    // Link the blocks filepath2 needs after its last block
+    unsigned tail = getBlockMap(getFirstBlock(ref2.entry)).back();
+    unsigned no_blocks = (size1 + size2) / BLOCK_SIZE - size2 / BLOCK_SIZE;
+    if (getNoFreeBlocks() < no_blocks)
     {
-      // Read last block of filepath2 and start writing at the end
-      disk.read(filepath2_block, (uint8_t *)block);
-      for (int i = size2 % BLOCK_SIZE; i < BLOCK_SIZE; i++)
+      std::cout << "No enough free blocks on disk" << std::endl;
+      return -1;
+    }
+    int tail_next = fat[tail];
+    if (no_blocks)
+      updateFAT(tail, no_blocks);
+
+    // If reading or writing fails the blocks linked above are given back,
+    // filepath2 keeps its old size
+    auto undo = [&]()
+    {
+      if (no_blocks)
       {
-        block[i] = filepath1_data[data_index];
-        data_index++;
+        freeChain(fat[tail]);
+        setFAT(tail, tail_next);
       }
-      first_iteration = 0;
-    }
-    else
+      writeFAT();
+      return -1;
+    };
+
+    // Stream filepath1 into filepath2 through two IO_BATCH block buffers,
+    // dest holds the blocks of filepath2 being filled, starting with the
+    // part of its last block that is in use
+    std::vector<uint8_t> dest(IO_BATCH * BLOCK_SIZE, 0);
+    size_t filled = size2 % BLOCK_SIZE;
+    int dest_block = tail;
+    if (cache.read(tail, dest.data()))
+      return undo();
+    std::memset(&dest[filled], 0, BLOCK_SIZE - filled);
+
+    // Writes the first count blocks of dest to the next blocks of filepath2
+    auto flush = [&](unsigned count)
     {
-      // Write to a new block
-      for (int i = 0; i < BLOCK_SIZE; i++)
+      std::vector<unsigned> blocks;
+      for (unsigned i = 0; i < count; i++)
       {
-        block[i] = filepath1_data[data_index];
-        data_index++;
+        blocks.push_back(dest_block);
+        dest_block = fat[dest_block];
       }
-    }
-    disk.write(filepath2_block, (uint8_t *)block);
-    filepath2_block = fat[filepath2_block];
-  }
-
-  // Update filepath2.size in the working directory block
-  for (auto &dir : working_directory)
-  {
-    if (std::string(dir.file_name) == file2)
+      return cache.write_blocks(blocks, dest.data());
+    };
+
+    // The source chain is followed through the FAT and cut at size1, so
+    // appending a file to itself stops at its old end
+    int source_block = filepath1_block;
+    uint32_t left = size1;
+    std::vector<uint32_t> chunks;
+    if (isCompressed(ref1.entry) && loadChunks(ref1.entry, chunks))
+      return undo();
+    while (left > 0)
     {
-      dir.size = size1 + size2;
-      break;
+      size_t length = left;
+      if (isCompressed(ref1.entry))
+      {
+        // A compressed source is read a chunk at a time
+        int chunk = readChunk(ref1.entry, chunks, (size1 - left) / CHUNK_SIZE, source.data());
+        if (chunk < 0)
+          return undo();
+        length = chunk;
+      }
+      else if (source_block == FAT_HOLE)
+      {
+        // The rest of a sparse filepath1 is a hole and reads as zeros
+        length = std::min<size_t>(left, source.size());
+        std::memset(source.data(), 0, length);
+      }
+      else if (!isPacked(ref1.entry))
+      {
+        std::vector<unsigned> batch;
+        while (batch.size() < IO_BATCH && batch.size() * BLOCK_SIZE < left && source_block != FAT_HOLE)
+        {
+          batch.push_back(source_block);
+          source_block = fat[source_block];
+        }
+        if (cache.read_blocks(batch, source.data()))
+          return undo();
+        length = std::min<size_t>(left, batch.size() * BLOCK_SIZE);
+      }
+
+      for (size_t done = 0; done < length;)
+      {
+        size_t n = std::min(length - done, dest.size() - filled);
+        std::memcpy(&dest[filled], &source[done], n);
+        filled += n;
+        done += n;
+        if (filled == dest.size())
+        {
+          if (flush(IO_BATCH))
+            return undo();
+          filled = 0;
+        }
+      }
+      left -= length;
     }
-  }
 
-  disk.write(temp_cwd, (uint8_t *)working_directory);
+    // The last block is cleared past the end of the file
+    std::memset(&dest[filled], 0, BLOCK_SIZE - filled % BLOCK_SIZE);
+    if (flush(filled / BLOCK_SIZE + 1))
+      return undo();
+  }
 
+  // Update filepath2.size in its directory
+  ref2.entry.size = size1 + size2;
+  updateEntry(ref2);
 
-  disk.read(FAT_BLOCK, (uint8_t*)fat);
+  writeFAT();
 
   return 0;
 }
@@ -884,16 +1156,12 @@ int FS::append(std::string filepath1, std::string filepath2)
 // in the current directory
 int FS::mkdir(std::string dirpath)
 {
-  // Read working directory block and FAT
-  disk.read(cwd, (uint8_t *)working_directory);
-  disk.read(FAT_BLOCK, (uint8_t *)fat);
-
   std::vector<std::string> filepath = interpretFilepath(dirpath);
   std::string new_directory = filepath.back();
   filepath.pop_back();
 
-  if (new_directory.length() >= 56) {
-    std::cout << "Filename " << new_directory << " exceeds 55 characters" << std::endl;
+  if (new_directory.length() > maxNameLength()) {
+    std::cout << "Filename " << new_directory << " exceeds " << maxNameLength() << " characters" << std::endl;
     return -1;
   }
 
@@ -905,64 +1173,47 @@ int FS::mkdir(std::string dirpath)
     return -1;
   }
 
-  disk.read(temp_cwd, (uint8_t *)working_directory);
-
   // Make sure filepath doesn't already exist
-  for (auto &dir : working_directory)
+  file_ref existing;
+  if (findEntry(temp_cwd, new_directory, existing) == 0)
   {
-    if (dir.file_name == new_directory && dir.type != TYPE_EMPTY)
-    {
-      std::cout << new_directory << " already exists" << std::endl;
-      return -1;
-    }
+    std::cout << new_directory << " already exists" << std::endl;
+    return -1;
   }
 
-  int current_block = findFirstFreeBlock();
+  // Write FAT to disk
+  int current_block = allocateChain(1);
   if (current_block == -1)
   {
     std::cout << "No free block on disk" << std::endl;
     return -1;
   }
 
-  // Create dir_entry for directory
-  dir_entry dir_ent;
-  std::strcpy(dir_ent.file_name, new_directory.c_str());
-  dir_ent.size = 0;
-  dir_ent.first_blk = current_block;
-  dir_ent.type = TYPE_DIR;
-  dir_ent.access_rights = READ | WRITE | EXECUTE;
-
-  // Write FAT to disk
-  updateFAT(dir_ent.first_blk, 1);
-
-  // Write to working directory block
-  dir_entry *ptr = &dir_ent;
-  createDirEntry(ptr, temp_cwd);
-
   // Create dir_entry ".." first in this directory's block
   std::string filename = "..";
+  dir_entry dir_ent;
   std::strcpy(dir_ent.file_name, filename.c_str());
   dir_ent.size = 0;
-  dir_ent.first_blk = temp_cwd; // parent directory block
+  setFirstBlock(dir_ent, temp_cwd); // parent directory block
   dir_ent.type = TYPE_DIR;
   dir_ent.access_rights = READ | WRITE | EXECUTE;
 
-  working_directory[0] = dir_ent;
+  initDirBlock(current_block, &dir_ent);
 
-  // Change dir_entry to be empty
-  filename = "";
-  std::strcpy(dir_ent.file_name, filename.c_str());
-  dir_ent.first_blk = 0;
-  dir_ent.type = TYPE_EMPTY;
-  dir_ent.access_rights = 0;
+  // Create dir_entry for directory
+  std::strcpy(dir_ent.file_name, new_directory.c_str());
+  setFirstBlock(dir_ent, current_block);
 
-  // Fill rest of dir block with empty dir_entry
-  for (int i = 1; i < BLOCK_SIZE / 64; i++)
+  // Write to working directory block
+  if (addEntry(temp_cwd, dir_ent))
   {
-    working_directory[i] = dir_ent;
+    freeChain(current_block);
+    writeFAT();
+    std::cout << "Full directory" << std::endl;
+    return -1;
   }
 
-  disk.write(current_block, (uint8_t *)working_directory);
+  writeFAT();
 
   return 0;
 }
@@ -973,7 +1224,6 @@ int FS::cd(std::string dirpath)
   // Interpret string to determine the steps required
   std::vector<std::string> filepath = interpretFilepath(dirpath);
 
-  disk.read(cwd, (uint8_t *)working_directory);
   int temp_cwd = traverseToDir(filepath);
 
   if (temp_cwd == -1)
@@ -982,6 +1232,7 @@ int FS::cd(std::string dirpath)
     return -1;
   }
   cwd = temp_cwd;
+  cwd_path = getPath(cwd);
 
   return 0;
 }
@@ -990,35 +1241,12 @@ int FS::cd(std::string dirpath)
 // directory, including the currect directory name
 int FS::pwd()
 {
-  // Read working directory
-  disk.read(cwd, (uint8_t *)working_directory);
-  uint16_t current_dir = cwd;
-  std::string path = "";
-
-  // Build absolute path string by walking to root directory
-  while (current_dir != ROOT_BLOCK)
-  {
-    uint16_t parent_dir = working_directory[0].first_blk;
-    disk.read(parent_dir, (uint8_t *)working_directory);
+  // The path is kept by cd, it is only rebuilt after a directory above
+  // cwd has been renamed or moved
+  if (cwd_path.empty())
+    cwd_path = getPath(cwd);
 
-    bool found = false;
-    // Search in parent directory for current directory's filename
-    for (auto &dir_ent : working_directory)
-    {
-      if (dir_ent.first_blk == current_dir)
-      {
-        path = dir_ent.file_name + path;
-        path = "/" + path;
-        break;
-      }
-    }
-    current_dir = parent_dir;
-  }
-
-  if (path[0] != '/')
-    path = "/" + path;
-
-  std::cout << path << std::endl;
+  std::cout << cwd_path << std::endl;
 
   return 0;
 }
@@ -1027,9 +1255,6 @@ int FS::pwd()
 // file <filepath> to <accessrights>.
 int FS::chmod(std::string accessrights, std::string filepath)
 {
-  // Refresh working_directory
-  disk.read(cwd, (uint8_t *)working_directory);
-
   std::vector<std::string> file_vec = interpretFilepath(filepath);
   std::string filename = file_vec.back();
   file_vec.pop_back();
@@ -1042,206 +1267,2219 @@ int FS::chmod(std::string accessrights, std::string filepath)
     return -1;
   }
 
-  // Read working directory block
-  disk.read(temp_cwd, (uint8_t *)working_directory);
-
-  // Check that filepath exists (in cwd only)
-  bool found_dir = false;
-  for (auto &dir : working_directory)
+  // Check that filepath exists
+  file_ref ref;
+  if (findEntry(temp_cwd, filename, ref))
   {
-    if (std::string(dir.file_name) == filename && dir.type != TYPE_EMPTY)
-    {
-      found_dir = true;
-      dir.access_rights = std::stoi(accessrights);
-      disk.write(temp_cwd, (uint8_t *)working_directory);
-    }
+    std::cout << "File not found" << std::endl;
+    return -1;
   }
 
-  if (!found_dir)
+  // Only the read, write and execute bits can be set, the packing and
+  // compression bits above them are kept
+  if (accessrights.empty() || accessrights.find_first_not_of("0123456789") != std::string::npos ||
+      accessrights.length() > 9 || std::stoi(accessrights) > RIGHTS_MASK)
   {
-    std::cout << "File not found" << std::endl;
+    std::cout << "Invalid access rights " << accessrights << std::endl;
     return -1;
   }
+  uint8_t rights = std::stoi(accessrights);
+  ref.entry.access_rights = rights | (ref.entry.access_rights & ~RIGHTS_MASK);
+  updateEntry(ref);
 
   return 0;
 }
 
-int FS::findFirstFreeBlock()
+// open <filepath> opens an existing file for reading and/or writing,
+// mode is READ, WRITE or both. Returns a file descriptor or -1.
+int FS::open(std::string filepath, uint8_t mode)
 {
-  int block_no = -1;
+  std::vector<std::string> filepath_vec = interpretFilepath(filepath);
+  std::string file = filepath_vec.back();
+  filepath_vec.pop_back();
 
-  for (int i = 2; i < BLOCK_SIZE / 2; i++)
+  int temp_cwd = traverseToDir(filepath_vec);
+  if (temp_cwd == -1)
   {
-    if (fat[i] == FAT_FREE)
-    {
-      block_no = i;
-      break;
-    }
+    std::cout << "Invalid path " << filepath << std::endl;
+    return -1;
   }
-  return block_no;
-}
 
-int FS::getNoFreeBlocks()
-{
-  int number = 0;
-  for (int i = 2; i < BLOCK_SIZE / 2; i++)
+  file_ref ref;
+  if (findEntry(temp_cwd, file, ref) || ref.entry.type != TYPE_FILE)
   {
-    if (fat[i] == 0)
-    {
-      number++;
-    }
+    std::cout << "File " << file << " does not exist." << std::endl;
+    return -1;
   }
-  return number;
-}
-
-int FS::createDirEntry(dir_entry *de, int dir_block)
-{
-  int not_empty = 0;
-
-  // Read working directory block
-  disk.read(dir_block, (uint8_t *)working_directory);
 
-  int k = 1;
-  for (k; k < BLOCK_SIZE / 64; k++)
+  mode &= READ | WRITE;
+  if (!mode || (getRights(ref.entry) & mode) != mode)
   {
-    if (working_directory[k].type == TYPE_EMPTY) // first empty in working directory block
-      break;
-  }
-  if (k == BLOCK_SIZE / 64)
+    std::cout << "File " << file << " does not have " << accessRightsToString(mode) << " permission" << std::endl;
     return -1;
+  }
 
-  // Edit working directory block
-  working_directory[k] = *de;
-
-  // Write working directory block to disk
-  disk.write(dir_block, (uint8_t *)working_directory);
-
-  return 0;
-}
-
-void FS::updateFAT(int block_start, uint32_t size)
-{
-  disk.read(FAT_BLOCK, (uint8_t*)fat);
-  int current_block;
-
-    for (int i = 0; i < size; i++)
-    {
-      current_block = findFirstFreeBlock();
-      fat[block_start] = current_block;
-      block_start = current_block;
-      fat[current_block] = FAT_EOF;
-    }
-
-
-  disk.write(FAT_BLOCK, (uint8_t *)fat);
+  // Lowest free descriptor
+  int fd = 0;
+  while (fd < (int)open_files.size() && open_files[fd].mode)
+    fd++;
+  if (fd == MAX_OPEN_FILES)
+  {
+    std::cout << "Too many open files" << std::endl;
+    return -1;
+  }
+  if (fd == (int)open_files.size())
+    open_files.emplace_back();
+
+  open_file &of = open_files[fd];
+  of.ref = ref;
+  of.mode = mode;
+  of.pos = 0;
+  of.first_blk = getFirstBlock(ref.entry);
+  of.cur_index = 0;
+  of.cur_block = of.first_blk;
+  of.chunks.clear();
+  return fd;
 }
 
-std::vector<std::string> FS::interpretFilepath(std::string dirpath)
+// close <fd> frees the file descriptor fd
+int FS::close(int fd)
 {
-  std::vector<std::string> path_vec;
-  char delimiter = '/';
-  if (dirpath[0] == delimiter)
-    path_vec.push_back("/");
-
-  // Interpret string to determine the steps required
-  std::istringstream iss(dirpath);
-  std::string path;
-  while (std::getline(iss, path, delimiter))
+  if (fd < 0 || fd >= (int)open_files.size() || !open_files[fd].mode)
   {
-    if (path == ".") // We don't have to change cwd if we encounter '.'
-      continue;
-
-    if (path.length())
-      path_vec.push_back(path);
-    path = "";
+    std::cout << "Bad file descriptor " << fd << std::endl;
+    return -1;
   }
-  return path_vec;
+  open_files[fd].mode = 0;
+  return 0;
 }
 
-std::string FS::accessRightsToString(uint8_t access_rights)
+// pread reads at most count bytes at offset into buf, returns the number
+// of bytes read, 0 at the end of the file, or -1
+int FS::pread(int fd, void *buf, uint32_t count, uint32_t offset)
 {
-  std::string rwx = "---";
-  std::string rwx_chars = "rwx";
-  uint8_t rights[3] = {READ, WRITE, EXECUTE};
+  open_file *file = getFile(fd, READ);
+  if (!file)
+    return -1;
 
-  for (int i = 0; i < rwx.length(); i++)
+  uint32_t size = file->ref.entry.size;
+  if (offset >= size)
+    return 0;
+  count = std::min<uint32_t>({count, size - offset, INT32_MAX});
+  uint8_t *out = (uint8_t *)buf;
+
+  if (isPacked(file->ref.entry))
   {
-    if ((access_rights & rights[i]) == rights[i])
-      rwx[i] = rwx_chars[i];
+    uint8_t fragment[FRAG_SIZE];
+    if (readFragment(file->ref.entry, fragment))
+      return -1;
+    std::memcpy(out, fragment + offset, count);
+    return count;
   }
 
-  return rwx;
-}
+  if (isCompressed(file->ref.entry))
+  {
+    // Only the chunks holding the bytes are read, found by the chunk index
+    if (file->chunks.empty() && loadChunks(file->ref.entry, file->chunks))
+      return -1;
+    std::vector<uint8_t> chunk(CHUNK_SIZE);
+    uint32_t done = 0;
+    while (done < count)
+    {
+      unsigned start = (offset + done) % CHUNK_SIZE;
+      if (readChunk(file->ref.entry, file->chunks, (offset + done) / CHUNK_SIZE, chunk.data()) < 0)
+        return -1;
+      unsigned length = std::min<uint32_t>(CHUNK_SIZE - start, count - done);
+      std::memcpy(out + done, chunk.data() + start, length);
+      done += length;
+    }
+    return count;
+  }
 
-uint8_t FS::getDirAccessRights(int dir_block)
-{
+  uint8_t block[BLOCK_SIZE];
+  uint32_t done = 0;
+  while (done < count)
+  {
+    unsigned index = (offset + done) / BLOCK_SIZE;
+    unsigned start = (offset + done) % BLOCK_SIZE;
+    int block_no = fileBlock(*file, index);
 
-  // Find parent directory
-  for (auto &dir : working_directory)
-    if (std::string(dir.file_name) == "..")
+    if (block_no == FAT_HOLE)
     {
-      disk.read(dir.first_blk, (uint8_t *)working_directory);
+      // The rest of a sparse file is its hole, it reads as zeros
+      std::memset(out + done, 0, count - done);
       break;
     }
 
-  // Get access rights for directory
-  uint8_t access = 0;
-  for (auto &dir : working_directory)
-    if (dir.first_blk == dir_block && dir.type != TYPE_EMPTY)
+    if (start == 0 && count - done >= BLOCK_SIZE)
     {
-      access = dir.access_rights;
-      break;
+      // Whole blocks go straight to buf, IO_BATCH blocks at a time
+      std::vector<unsigned> batch(1, block_no);
+      while (batch.size() < IO_BATCH && count - done - batch.size() * BLOCK_SIZE >= BLOCK_SIZE &&
+             (block_no = fileBlock(*file, index + batch.size())) != FAT_HOLE)
+        batch.push_back(block_no);
+      if (cache.read_blocks(batch, out + done))
+        return -1;
+      done += batch.size() * BLOCK_SIZE;
+      continue;
     }
-  disk.read(dir_block, (uint8_t *)working_directory);
-  return access;
+
+    unsigned length = std::min<uint32_t>(BLOCK_SIZE - start, count - done);
+    if (cache.read(block_no, block))
+      return -1;
+    std::memcpy(out + done, block + start, length);
+    done += length;
+  }
+  return count;
 }
 
-int FS::traverseToDir(std::vector<std::string> filepath)
+// pwrite writes count bytes from buf at offset, the file grows if the
+// bytes go past its end and any gap reads as zeros
+int FS::pwrite(int fd, const void *buf, uint32_t count, uint32_t offset)
 {
-  int temp = cwd;
+  open_file *file = getFile(fd, WRITE);
+  if (!file)
+    return -1;
 
-  for (int i = 0; i < filepath.size(); i++)
+  if (count > INT32_MAX || (uint64_t)offset + count > UINT32_MAX)
   {
-    if (filepath[i] == "/") // absolute path, start from ROOT_BLOCK
-    {
-      temp = ROOT_BLOCK;
-      disk.read(temp, (uint8_t *)working_directory);
-      continue;
+    std::cout << "File too large" << std::endl;
+    return -1;
+  }
+  // Writing nothing does not grow the file, even past its end
+  if (count == 0)
+    return 0;
+  uint32_t old_size = file->ref.entry.size;
+  // A packed file that does not grow is written in its fragment
+  if (offset + count > old_size ? resizeFile(file->ref, offset + count)
+                                : !isPacked(file->ref.entry) && detachFile(file->ref))
+    return -1;
+  // A sparse file gets the blocks of its hole up to the last one written,
+  // it keeps its old size if they do not fit
+  if (fillHole(file->ref, (offset + count - 1) / BLOCK_SIZE + 1))
+  {
+    if (file->ref.entry.size != old_size)
+      resizeFile(file->ref, old_size);
+    return -1;
+  }
+  const uint8_t *in = (const uint8_t *)buf;
+
+  if (isPacked(file->ref.entry))
+  {
+    uint8_t fragment[FRAG_SIZE];
+    if (readFragment(file->ref.entry, fragment))
+      return -1;
+    std::memcpy(fragment + offset, in, count);
+    return writeFragment(file->ref.entry, fragment) ? -1 : count;
+  }
+
+  uint8_t block[BLOCK_SIZE];
+  uint32_t done = 0;
+  while (done < count)
+  {
+    unsigned index = (offset + done) / BLOCK_SIZE;
+    unsigned start = (offset + done) % BLOCK_SIZE;
+
+    if (start == 0 && count - done >= BLOCK_SIZE)
+    {
+      // Whole blocks are written from buf, IO_BATCH blocks at a time
+      std::vector<unsigned> batch;
+      while (batch.size() < IO_BATCH && count - done - batch.size() * BLOCK_SIZE >= BLOCK_SIZE)
+        batch.push_back(fileBlock(*file, index + batch.size()));
+      if (cache.write_blocks(batch, in + done))
+        return -1;
+      done += batch.size() * BLOCK_SIZE;
+      continue;
+    }
+
+    // Part of a block, the rest of it is kept
+    unsigned length = std::min<uint32_t>(BLOCK_SIZE - start, count - done);
+    unsigned block_no = fileBlock(*file, index);
+    if (cache.read(block_no, block))
+      return -1;
+    std::memcpy(block + start, in + done, length);
+    if (cache.write(block_no, block))
+      return -1;
+    done += length;
+  }
+  return count;
+}
+
+// read and write are pread and pwrite at the position of fd, which moves
+// past the bytes read or written
+int FS::read(int fd, void *buf, uint32_t count)
+{
+  if (!getFile(fd, READ))
+    return -1;
+  int ret = pread(fd, buf, count, open_files[fd].pos);
+  if (ret > 0)
+    open_files[fd].pos += ret;
+  return ret;
+}
+
+int FS::write(int fd, const void *buf, uint32_t count)
+{
+  if (!getFile(fd, WRITE))
+    return -1;
+  int ret = pwrite(fd, buf, count, open_files[fd].pos);
+  if (ret > 0)
+    open_files[fd].pos += ret;
+  return ret;
+}
+
+// lseek sets the position of fd to offset from the start (SEEK_SET), the
+// position (SEEK_CUR) or the end (SEEK_END), returns the new position
+int64_t FS::lseek(int fd, int64_t offset, int whence)
+{
+  open_file *file = getFile(fd, 0);
+  if (!file)
+    return -1;
+
+  int64_t pos;
+  if (whence == SEEK_SET)
+    pos = offset;
+  else if (whence == SEEK_CUR)
+    pos = file->pos + offset;
+  else if (whence == SEEK_END)
+    pos = file->ref.entry.size + offset;
+  else
+  {
+    std::cout << "Invalid whence " << whence << std::endl;
+    return -1;
+  }
+
+  if (pos < 0 || pos > UINT32_MAX)
+  {
+    std::cout << "Invalid offset " << pos << std::endl;
+    return -1;
+  }
+  file->pos = pos;
+  return pos;
+}
+
+// truncate sets the size of the file, new bytes read as zeros
+int FS::truncate(int fd, uint32_t size)
+{
+  open_file *file = getFile(fd, WRITE);
+  if (!file)
+    return -1;
+  return resizeFile(file->ref, size);
+}
+
+// sync writes all modified blocks in the block cache to the disk
+int FS::sync()
+{
+  if (writeDedup() || writeFAT() || cache.sync())
+  {
+    std::cout << "Could not write cached blocks to disk" << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+// cache-stats prints the hit/miss counters of the block cache
+int FS::cacheStats()
+{
+  unsigned long hits = cache.get_hits(), misses = cache.get_misses();
+  unsigned long lookups = hits + misses;
+
+  std::cout << "capacity:   " << cache.get_capacity() << " blocks" << std::endl;
+  std::cout << "resident:   " << cache.get_resident() << " blocks" << std::endl;
+  std::cout << "hits:       " << hits << std::endl;
+  std::cout << "misses:     " << misses << std::endl;
+  std::cout << "hit ratio:  " << std::fixed << std::setprecision(1)
+            << (lookups ? 100.0 * hits / lookups : 0.0) << "%" << std::endl;
+  std::cout << "writebacks: " << cache.get_writebacks() << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+  return 0;
+}
+
+// dedup-stats prints the space saved by dedup and shared chains, and what
+// the dedup index lookups cost
+int FS::dedupStats()
+{
+  loadDedup();
+  loadRefs();
+
+  // Every file after the first on a shared chain saves its blocks
+  unsigned long shared_saved = 0;
+  for (auto &chain : chain_refs)
+    shared_saved += (unsigned long)(chain.second - 1) * getBlockMap(chain.first).size();
+
+  double lookup_us = std::chrono::duration<double, std::micro>(dedup_time).count();
+  std::cout << "dedup:          " << (dedup ? "on" : "off") << std::endl;
+  std::cout << "index entries:  " << dedup_chains.size() << std::endl;
+  std::cout << "lookups:        " << dedup_lookups << std::endl;
+  std::cout << "hits:           " << dedup_hits << std::endl;
+  std::cout << "blocks saved:   " << dedup_saved << " (" << dedup_saved * BLOCK_SIZE / 1024 << " KiB)" << std::endl;
+  std::cout << "shared chains:  " << chain_refs.size() << ", " << shared_saved << " blocks saved" << std::endl;
+  std::cout << "verify reads:   " << dedup_verify_reads << " blocks" << std::endl;
+  std::cout << "lookup time:    " << std::fixed << std::setprecision(1) << lookup_us << " us, "
+            << (dedup_lookups ? lookup_us / dedup_lookups : 0.0) << " us per lookup" << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+  return 0;
+}
+
+// reads the superblock and the FAT, a volume without a superblock is a v1
+// volume with the FAT in FAT_BLOCK
+int FS::mount()
+{
+  uint8_t block[BLOCK_SIZE];
+  cache.read(SUPER_BLOCK, block);
+  std::memcpy(&sb, block, sizeof(sb));
+
+  bool v2 = sb.magic == FS_MAGIC && sb.version == FS_VERSION;
+  if (v2 && sb.block_size != BLOCK_SIZE)
+  {
+    std::cout << "Unsupported block size " << sb.block_size << ", format the disk" << std::endl;
+    v2 = false;
+  }
+
+  if (v2)
+  {
+    if (sb.no_blocks != disk.get_no_blocks())
+      disk.resize(sb.no_blocks);
+  }
+  else
+  {
+    sb.magic = 0;
+    sb.version = 1;
+    sb.block_size = BLOCK_SIZE;
+    sb.no_blocks = NO_BLOCKS;
+    sb.fat_start = FAT_BLOCK;
+    sb.fat_blocks = 1;
+    sb.dedup_start = 0;
+    sb.dedup_entries = 0;
+  }
+  data_start = sb.fat_start + sb.fat_blocks;
+
+  fat.assign(sb.no_blocks, FAT_FREE);
+  clearBlockMaps();
+  clearDirIndexes();
+  clearDentries();
+  inodes.clear();
+  frag_used.clear();
+  frag_partial.clear();
+  frags_loaded = false;
+  chain_refs.clear();
+  refs_loaded = false;
+  dedup_chains.clear();
+  dedup_hashes.clear();
+  dedup_loaded = false;
+  dedup_dirty = false;
+  // Descriptors on the old volume would find unrelated files on this one
+  open_files.clear();
+  int ret = readFAT();
+  rebuildFreeMap();
+  return ret;
+}
+
+// reads the whole FAT from disk into fat, this is only done at mount, after
+// that fat is kept in memory and is the authoritative copy
+int FS::readFAT()
+{
+  fat_dirty.assign(sb.fat_blocks, false);
+
+  if (sb.version == 1)
+  {
+    int16_t fat16[BLOCK_SIZE / 2];
+    if (cache.read(FAT_BLOCK, (uint8_t *)fat16))
+      return -1;
+    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+      fat[i] = fat16[i];
+    return 0;
+  }
+
+  std::vector<unsigned> blocks;
+  for (unsigned i = 0; i < sb.fat_blocks; i++)
+    blocks.push_back(sb.fat_start + i);
+  std::vector<int32_t> entries(sb.fat_blocks * FAT_ENTRIES);
+  if (cache.read_blocks(blocks, (uint8_t *)entries.data()))
+    return -1;
+  std::copy(entries.begin(), entries.begin() + sb.no_blocks, fat.begin());
+  return 0;
+}
+
+// writes the FAT blocks that have changed since the last call to disk,
+// called when an operation is done and at sync
+int FS::writeFAT()
+{
+  if (sb.version == 1)
+  {
+    if (!fat_dirty[0])
+      return 0;
+    int16_t fat16[BLOCK_SIZE / 2];
+    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+      fat16[i] = fat[i];
+    if (cache.write(FAT_BLOCK, (uint8_t *)fat16))
+      return -1;
+    fat_dirty[0] = false;
+    return 0;
+  }
+
+  for (unsigned i = 0; i < sb.fat_blocks; i++)
+  {
+    if (!fat_dirty[i])
+      continue;
+    int32_t entries[FAT_ENTRIES] = {0};
+    unsigned count = std::min<unsigned>(FAT_ENTRIES, sb.no_blocks - i * FAT_ENTRIES);
+    std::copy(fat.begin() + i * FAT_ENTRIES, fat.begin() + i * FAT_ENTRIES + count, entries);
+    if (cache.write(sb.fat_start + i, (uint8_t *)entries))
+      return -1;
+    fat_dirty[i] = false;
+  }
+  return 0;
+}
+
+// block numbers on v2 volumes are 32 bits, the upper half is kept in the
+// last two bytes of file_name
+unsigned FS::getFirstBlock(const dir_entry &de)
+{
+  if (sb.version == 1)
+    return de.first_blk;
+  uint16_t high;
+  std::memcpy(&high, de.file_name + 54, sizeof(high));
+  return (unsigned)high << 16 | de.first_blk;
+}
+
+void FS::setFirstBlock(dir_entry &de, unsigned block_no)
+{
+  de.first_blk = block_no & 0xFFFF;
+  if (sb.version == 1)
+    return;
+  uint16_t high = block_no >> 16;
+  std::memcpy(de.file_name + 54, &high, sizeof(high));
+}
+
+// the file name of de, on v2 volumes it is followed by the upper half of
+// the first block so it is not always terminated at the end of file_name
+std::string FS::getName(const dir_entry &de)
+{
+  return std::string(de.file_name, strnlen(de.file_name, maxNameLength() + 1));
+}
+
+// the read, write and execute bits of de, without the packing and
+// compression bits
+uint8_t FS::getRights(const dir_entry &de)
+{
+  return de.access_rights & RIGHTS_MASK;
+}
+
+// whether de, a new file with its size set, should be put in a fragment
+bool FS::canPack(const dir_entry &de)
+{
+  return sb.version != 1 && de.type == TYPE_FILE && de.size <= FRAG_SIZE;
+}
+
+bool FS::isPacked(const dir_entry &de)
+{
+  return sb.version != 1 && de.type == TYPE_FILE && (de.access_rights & FLAG_PACKED);
+}
+
+bool FS::isCompressed(const dir_entry &de)
+{
+  return sb.version != 1 && de.type == TYPE_FILE && !isPacked(de) && (de.access_rights & FLAG_COMPRESSED);
+}
+
+// finds the fragments in use by going through every file, this is done
+// the first time a fragment is allocated or freed after mount
+void FS::loadFragments()
+{
+  if (frags_loaded)
+    return;
+  frags_loaded = true;
+
+  std::vector<file_ref> files;
+  collectFiles(ROOT_BLOCK, files);
+  for (auto &file : files)
+  {
+    if (!isPacked(file.entry))
+      continue;
+    unsigned slot = (file.entry.access_rights & FRAG_SLOT_MASK) >> FRAG_SLOT_SHIFT;
+    frag_used[getFirstBlock(file.entry)] |= 1 << slot;
+  }
+  for (auto &block : frag_used)
+    if (block.second != (1 << FRAGS_PER_BLOCK) - 1)
+      frag_partial.insert(block.first);
+}
+
+// gives de a free fragment, a new fragment block is allocated if every
+// fragment block is full
+int FS::allocateFragment(dir_entry &de)
+{
+  loadFragments();
+
+  unsigned block;
+  if (frag_partial.empty())
+  {
+    int block_no = allocateChain(1);
+    if (block_no == -1)
+      return -1;
+    block = block_no;
+    frag_used[block] = 0;
+    frag_partial.insert(block);
+  }
+  else
+    block = *frag_partial.begin();
+
+  uint8_t &used = frag_used[block];
+  unsigned slot = __builtin_ctz(~used);
+  used |= 1 << slot;
+  if (used == (1 << FRAGS_PER_BLOCK) - 1)
+    frag_partial.erase(block);
+
+  setFirstBlock(de, block);
+  de.access_rights = (de.access_rights & RIGHTS_MASK) | FLAG_PACKED | slot << FRAG_SLOT_SHIFT;
+  return 0;
+}
+
+// releases the fragment of de, and its block when no fragment is left
+void FS::freeFragment(const dir_entry &de)
+{
+  loadFragments();
+
+  unsigned block = getFirstBlock(de);
+  unsigned slot = (de.access_rights & FRAG_SLOT_MASK) >> FRAG_SLOT_SHIFT;
+  uint8_t &used = frag_used[block];
+  used &= ~(1 << slot);
+  if (used)
+  {
+    frag_partial.insert(block);
+    return;
+  }
+  frag_used.erase(block);
+  frag_partial.erase(block);
+  setFAT(block, FAT_FREE);
+}
+
+// reads the FRAG_SIZE bytes of the fragment of de into buf
+int FS::readFragment(const dir_entry &de, uint8_t *buf)
+{
+  uint8_t block[BLOCK_SIZE];
+  if (cache.read(getFirstBlock(de), block))
+    return -1;
+  unsigned slot = (de.access_rights & FRAG_SLOT_MASK) >> FRAG_SLOT_SHIFT;
+  std::memcpy(buf, block + slot * FRAG_SIZE, FRAG_SIZE);
+  return 0;
+}
+
+// writes FRAG_SIZE bytes from data to the fragment of de
+int FS::writeFragment(const dir_entry &de, const uint8_t *data)
+{
+  uint8_t block[BLOCK_SIZE];
+  if (cache.read(getFirstBlock(de), block))
+    return -1;
+  unsigned slot = (de.access_rights & FRAG_SLOT_MASK) >> FRAG_SLOT_SHIFT;
+  std::memcpy(block + slot * FRAG_SIZE, data, FRAG_SIZE);
+  return cache.write(getFirstBlock(de), block);
+}
+
+// frees the fragment or the chain holding the data of de, a chain shared
+// with other files is kept for them
+void FS::freeData(const dir_entry &de)
+{
+  if (isPacked(de))
+    freeFragment(de);
+  else if (de.type != TYPE_FILE || unrefChain(getFirstBlock(de)) == 0)
+  {
+    dropHash(getFirstBlock(de));
+    freeChain(getFirstBlock(de));
+  }
+}
+
+// returns the descriptor fd after looking its file up again, so changes
+// made by other commands are seen. mode is the access fd must have.
+open_file *FS::getFile(int fd, uint8_t mode)
+{
+  if (fd < 0 || fd >= (int)open_files.size() || !open_files[fd].mode)
+  {
+    std::cout << "Bad file descriptor " << fd << std::endl;
+    return nullptr;
+  }
+
+  open_file &file = open_files[fd];
+  if ((file.mode & mode) != mode)
+  {
+    std::cout << "File descriptor " << fd << " is not open for " << accessRightsToString(mode) << std::endl;
+    return nullptr;
+  }
+  if (file.ref.entry.type != TYPE_FILE || findEntry(file.ref.dir, getName(file.ref.entry), file.ref))
+  {
+    std::cout << "File of descriptor " << fd << " has been removed" << std::endl;
+    file.ref.entry.type = TYPE_EMPTY;
+    return nullptr;
+  }
+
+  // The chain is new if the file was moved by defrag or out of a fragment
+  if (getFirstBlock(file.ref.entry) != file.first_blk)
+  {
+    file.first_blk = getFirstBlock(file.ref.entry);
+    file.cur_index = 0;
+    file.cur_block = file.first_blk;
+    file.chunks.clear();
+  }
+  return &file;
+}
+
+// returns the block at index in the chain of file, or FAT_HOLE if index is
+// past the chain, in the hole of a sparse file. The chain is followed from
+// the last block used when index is past it, so reading or writing front
+// to back walks the chain once.
+int FS::fileBlock(open_file &file, unsigned index)
+{
+  if (index < file.cur_index)
+  {
+    file.cur_index = 0;
+    file.cur_block = file.first_blk;
+  }
+  while (file.cur_index < index && fat[file.cur_block] != FAT_EOF && fat[file.cur_block] != FAT_HOLE)
+  {
+    file.cur_block = fat[file.cur_block];
+    file.cur_index++;
+  }
+  return file.cur_index == index ? file.cur_block : FAT_HOLE;
+}
+
+// counts the files using every chain, this is done the first time a
+// chain is shared or released after mount
+void FS::loadRefs()
+{
+  if (refs_loaded)
+    return;
+  refs_loaded = true;
+
+  std::vector<file_ref> files;
+  collectFiles(ROOT_BLOCK, files);
+  for (auto &file : files)
+    if (!isPacked(file.entry))
+      chain_refs[getFirstBlock(file.entry)]++;
+  for (auto it = chain_refs.begin(); it != chain_refs.end();)
+  {
+    if (it->second == 1)
+      it = chain_refs.erase(it);
+    else
+      ++it;
+  }
+}
+
+// whether more than one file uses the chain starting at first_blk
+bool FS::isShared(unsigned first_blk)
+{
+  loadRefs();
+  return chain_refs.count(first_blk);
+}
+
+// adds a file to the chain starting at first_blk
+void FS::refChain(unsigned first_blk)
+{
+  loadRefs();
+  auto it = chain_refs.find(first_blk);
+  if (it == chain_refs.end())
+    chain_refs[first_blk] = 2;
+  else
+    it->second++;
+}
+
+// removes a file from the chain starting at first_blk, returns the number
+// of files still using it
+unsigned FS::unrefChain(unsigned first_blk)
+{
+  loadRefs();
+  auto it = chain_refs.find(first_blk);
+  if (it == chain_refs.end())
+    return 0;
+  unsigned refs = --it->second;
+  if (refs == 1)
+    chain_refs.erase(it);
+  return refs;
+}
+
+// copies the chain starting at first_blk to new blocks, returns the first
+// of them or -1 if the disk is full or the copy fails
+int FS::copyChain(unsigned first_blk)
+{
+  std::vector<unsigned> from = getChain(first_blk);
+  int block_no = allocateChain(from.size());
+  if (block_no == -1)
+  {
+    std::cout << "Not enough free blocks on disk" << std::endl;
+    return -1;
+  }
+  std::vector<unsigned> to = getChain(block_no);
+
+  std::vector<uint8_t> data(IO_BATCH * BLOCK_SIZE);
+  for (unsigned i = 0; i < from.size(); i += IO_BATCH)
+  {
+    unsigned end = std::min<size_t>(i + IO_BATCH, from.size());
+    std::vector<unsigned> from_batch(from.begin() + i, from.begin() + end);
+    std::vector<unsigned> to_batch(to.begin() + i, to.begin() + end);
+    if (cache.read_blocks(from_batch, data.data()) || cache.write_blocks(to_batch, data.data()))
+    {
+      freeChain(block_no);
+      return -1;
+    }
+  }
+  setFAT(to.back(), fat[from.back()]); // the copy of a sparse file is sparse
+  return block_no;
+}
+
+// gives the file at ref a copy of its chain if it shares it with other
+// files, else takes it out of the dedup index. Called before the data or
+// the chain of a file is changed.
+int FS::unshareFile(file_ref &ref)
+{
+  if (isPacked(ref.entry) || ref.entry.type != TYPE_FILE)
+    return 0;
+  unsigned first_blk = getFirstBlock(ref.entry);
+  if (!isShared(first_blk))
+  {
+    dropHash(first_blk); // its content is about to change
+    return 0;
+  }
+
+  int block_no = copyChain(first_blk);
+  if (block_no == -1)
+    return -1;
+  unrefChain(first_blk);
+  setFirstBlock(ref.entry, block_no);
+  if (updateEntry(ref))
+    return -1;
+  resetOpenFiles(ref);
+  return 0;
+}
+
+// reads the dedup index from the chain named in the superblock, this is
+// done the first time it is used after mount
+void FS::loadDedup()
+{
+  if (dedup_loaded)
+    return;
+  dedup_loaded = true;
+  if (sb.version == 1 || sb.dedup_start == 0)
+    return;
+
+  std::vector<unsigned> chain = getChain(sb.dedup_start);
+  std::vector<dedup_entry> entries(chain.size() * DEDUP_ENTRIES);
+  if (cache.read_blocks(chain, (uint8_t *)entries.data()))
+    return;
+  for (unsigned i = 0; i < sb.dedup_entries && i < entries.size(); i++)
+  {
+    dedup_chains[entries[i].hash] = entries[i].first_blk;
+    dedup_hashes[entries[i].first_blk] = entries[i].hash;
+  }
+}
+
+// writes the dedup index to a new chain and points the superblock at it,
+// if it has changed. Called at sync.
+int FS::writeDedup()
+{
+  if (!dedup_dirty)
+    return 0;
+  dedup_dirty = false;
+
+  if (sb.dedup_start)
+    freeChain(sb.dedup_start);
+  sb.dedup_start = 0;
+  sb.dedup_entries = dedup_chains.size();
+
+  if (sb.dedup_entries)
+  {
+    int block_no = allocateChain((sb.dedup_entries + DEDUP_ENTRIES - 1) / DEDUP_ENTRIES);
+    if (block_no == -1)
+    {
+      // No room for it, it is rebuilt from the files written from now on
+      sb.dedup_entries = 0;
+      dedup_chains.clear();
+      dedup_hashes.clear();
+    }
+    else
+    {
+      std::vector<unsigned> chain = getChain(block_no);
+      std::vector<dedup_entry> entries(chain.size() * DEDUP_ENTRIES);
+      unsigned i = 0;
+      for (auto &entry : dedup_chains)
+        entries[i++] = {entry.first, entry.second, 0};
+      if (cache.write_blocks(chain, (const uint8_t *)entries.data()))
+        return -1;
+      sb.dedup_start = block_no;
+    }
+  }
+
+  uint8_t block[BLOCK_SIZE];
+  if (cache.read(SUPER_BLOCK, block))
+    return -1;
+  std::memcpy(block, &sb, sizeof(sb));
+  return cache.write(SUPER_BLOCK, block);
+}
+
+// takes the chain starting at first_blk out of the dedup index
+void FS::dropHash(unsigned first_blk)
+{
+  loadDedup();
+  auto it = dedup_hashes.find(first_blk);
+  if (it == dedup_hashes.end())
+    return;
+  dedup_chains.erase(it->second);
+  dedup_hashes.erase(it);
+  dedup_dirty = true;
+}
+
+// points the dedup index entry of the chain starting at from, if it has
+// one, at the same data moved to the chain starting at to
+void FS::moveHash(unsigned from, unsigned to)
+{
+  loadDedup();
+  auto it = dedup_hashes.find(from);
+  if (it == dedup_hashes.end())
+    return;
+  uint64_t hash = it->second;
+  dedup_hashes.erase(it);
+  dedup_hashes[to] = hash;
+  dedup_chains[hash] = to;
+  dedup_dirty = true;
+}
+
+// whole-file dedup: looks up hash, the hash of the blocks of the new file
+// de, in the dedup index. If a chain with the same content is found de is
+// pointed at it and its own chain is freed, else its chain is added to the
+// index.
+int FS::dedupFile(dir_entry &de, uint64_t hash)
+{
+  if (sb.version == 1)
+    return 0;
+  loadDedup();
+  auto start = std::chrono::steady_clock::now();
+  unsigned first_blk = getFirstBlock(de);
+  dedup_lookups++;
+
+  // The hash only picks the candidate, the blocks are compared
+  auto it = dedup_chains.find(hash);
+  bool hit = it != dedup_chains.end() && fat[it->second] != FAT_FREE && sameChain(it->second, first_blk);
+  if (hit)
+  {
+    unsigned no_blocks = getChain(first_blk).size();
+    refChain(it->second);
+    freeChain(first_blk);
+    setFirstBlock(de, it->second);
+    dedup_hits++;
+    dedup_saved += no_blocks;
+  }
+  else if (it == dedup_chains.end())
+  {
+    dedup_chains[hash] = first_blk;
+    dedup_hashes[first_blk] = hash;
+    dedup_dirty = true;
+  }
+
+  dedup_time += std::chrono::steady_clock::now() - start;
+  return hit;
+}
+
+// whether the chains starting at first_a and first_b have the same length
+// and the same data
+bool FS::sameChain(unsigned first_a, unsigned first_b)
+{
+  std::vector<unsigned> a = getChain(first_a), b = getChain(first_b);
+  if (a.size() != b.size() || fat[a.back()] != fat[b.back()])
+    return false;
+
+  std::vector<uint8_t> data_a(IO_BATCH * BLOCK_SIZE), data_b(IO_BATCH * BLOCK_SIZE);
+  for (unsigned i = 0; i < a.size(); i += IO_BATCH)
+  {
+    unsigned end = std::min<size_t>(i + IO_BATCH, a.size());
+    std::vector<unsigned> batch_a(a.begin() + i, a.begin() + end);
+    std::vector<unsigned> batch_b(b.begin() + i, b.begin() + end);
+    if (cache.read_blocks(batch_a, data_a.data()) || cache.read_blocks(batch_b, data_b.data()))
+      return false;
+    dedup_verify_reads += 2 * (end - i);
+    if (std::memcmp(data_a.data(), data_b.data(), (end - i) * BLOCK_SIZE))
+      return false;
+  }
+  return true;
+}
+
+// moves the data of the packed file at ref to a block of its own
+int FS::unpackFile(file_ref &ref)
+{
+  uint8_t block[BLOCK_SIZE];
+  if (readFragment(ref.entry, block))
+    return -1;
+  std::memset(block + ref.entry.size, 0, BLOCK_SIZE - ref.entry.size);
+
+  int block_no = allocateChain(1);
+  if (block_no == -1)
+  {
+    std::cout << "Not enough free blocks on disk" << std::endl;
+    return -1;
+  }
+  cache.write(block_no, block);
+
+  freeFragment(ref.entry);
+  ref.entry.access_rights = getRights(ref.entry);
+  setFirstBlock(ref.entry, block_no);
+  if (updateEntry(ref))
+    return -1;
+  resetOpenFiles(ref);
+  return 0;
+}
+
+// writes the data of the compressed file at ref to a plain chain of its
+// own, a chunk at a time
+int FS::uncompressFile(file_ref &ref)
+{
+  std::vector<uint32_t> chunks;
+  if (loadChunks(ref.entry, chunks))
+    return -1;
+
+  int block_no = allocateChain(ref.entry.size / BLOCK_SIZE + 1);
+  if (block_no == -1)
+  {
+    std::cout << "Not enough free blocks on disk" << std::endl;
+    return -1;
+  }
+
+  // Every chunk fills CHUNK_SIZE / BLOCK_SIZE blocks of the new chain
+  std::vector<unsigned> chain = getChain(block_no);
+  std::vector<uint8_t> chunk(CHUNK_SIZE);
+  const unsigned chunk_blocks = CHUNK_SIZE / BLOCK_SIZE;
+  for (unsigned i = 0; i * chunk_blocks < chain.size(); i++)
+  {
+    int length = i + 1 < chunks.size() ? readChunk(ref.entry, chunks, i, chunk.data()) : 0;
+    if (length < 0)
+    {
+      freeChain(block_no);
+      return -1;
+    }
+    std::memset(chunk.data() + length, 0, CHUNK_SIZE - length);
+    std::vector<unsigned> batch(chain.begin() + i * chunk_blocks,
+                                chain.begin() + std::min<size_t>((i + 1) * chunk_blocks, chain.size()));
+    if (cache.write_blocks(batch, chunk.data()))
+    {
+      freeChain(block_no);
+      return -1;
+    }
+  }
+
+  // The old chain is let go while the entry still points at it, for the
+  // counts of shared chains to be built from
+  freeData(ref.entry);
+  ref.entry.access_rights = getRights(ref.entry);
+  setFirstBlock(ref.entry, block_no);
+  if (updateEntry(ref))
+    return -1;
+  resetOpenFiles(ref);
+  return 0;
+}
+
+// gives the file at ref a chain of its own with size / BLOCK_SIZE + 1
+// blocks of plain data, so its data can be changed in place
+int FS::detachFile(file_ref &ref)
+{
+  if (isPacked(ref.entry))
+    return unpackFile(ref);
+  if (isCompressed(ref.entry))
+    return uncompressFile(ref);
+  return unshareFile(ref);
+}
+
+// reads length bytes at offset in the chain starting at first_blk
+int FS::readChain(unsigned first_blk, uint64_t offset, uint32_t length, uint8_t *buf)
+{
+  const std::vector<unsigned> &chain = getBlockMap(first_blk);
+  uint8_t block[BLOCK_SIZE];
+  while (length > 0)
+  {
+    uint64_t index = offset / BLOCK_SIZE;
+    unsigned start = offset % BLOCK_SIZE;
+    if (index >= chain.size())
+      return -1;
+
+    if (start == 0 && length >= BLOCK_SIZE)
+    {
+      // Whole blocks go straight to buf, IO_BATCH blocks at a time
+      uint64_t end = std::min<uint64_t>({index + IO_BATCH, index + length / BLOCK_SIZE, chain.size()});
+      std::vector<unsigned> batch(chain.begin() + index, chain.begin() + end);
+      if (cache.read_blocks(batch, buf))
+        return -1;
+      buf += batch.size() * BLOCK_SIZE;
+      offset += batch.size() * BLOCK_SIZE;
+      length -= batch.size() * BLOCK_SIZE;
+      continue;
+    }
+
+    unsigned n = std::min<uint32_t>(BLOCK_SIZE - start, length);
+    if (cache.read(chain[index], block))
+      return -1;
+    std::memcpy(buf, block + start, n);
+    buf += n;
+    offset += n;
+    length -= n;
+  }
+  return 0;
+}
+
+// reads the chunk index of the compressed file de
+int FS::loadChunks(const dir_entry &de, std::vector<uint32_t> &chunks)
+{
+  unsigned first_blk = getFirstBlock(de);
+  compress_header header;
+  if (readChain(first_blk, 0, sizeof(header), (uint8_t *)&header) == 0 &&
+      header.chunk_size == CHUNK_SIZE && header.chunks == (de.size + CHUNK_SIZE - 1) / CHUNK_SIZE)
+  {
+    chunks.resize(header.chunks + 1);
+    if (readChain(first_blk, header.index_start, chunks.size() * sizeof(uint32_t), (uint8_t *)chunks.data()) == 0)
+      return 0;
+  }
+  chunks.clear();
+  std::cout << "Compressed file " << getName(de) << " is corrupt" << std::endl;
+  return -1;
+}
+
+// decompresses chunk i of the compressed file de to buf, which has room for
+// CHUNK_SIZE bytes. Returns the size of the chunk or -1.
+int FS::readChunk(const dir_entry &de, const std::vector<uint32_t> &chunks, unsigned i, uint8_t *buf)
+{
+  uint32_t size = std::min<uint32_t>(CHUNK_SIZE, de.size - i * CHUNK_SIZE);
+  uint32_t length = chunks[i + 1] - chunks[i];
+
+  // A chunk that did not get smaller is stored as it is
+  if (length == size)
+    return readChain(getFirstBlock(de), chunks[i], size, buf) ? -1 : size;
+
+  std::vector<uint8_t> compressed(length);
+  if (length > size || readChain(getFirstBlock(de), chunks[i], length, compressed.data()) ||
+      lz_decompress(compressed.data(), length, buf, size) != size)
+  {
+    std::cout << "Compressed file " << getName(de) << " is corrupt" << std::endl;
+    return -1;
+  }
+  return size;
+}
+
+// sets the size of the file at ref to size. A file keeps at most size /
+// BLOCK_SIZE + 1 blocks, or a fragment while it is small enough, and the
+// bytes past its end are zero so that growing it again reads zeros. The
+// blocks a file grows by are left as a hole, on v1 volumes they are
+// allocated and zeroed as the older tools cannot read a hole.
+int FS::resizeFile(file_ref &ref, uint32_t size)
+{
+  uint32_t old_size = ref.entry.size;
+  uint8_t block[BLOCK_SIZE];
+
+  if (isPacked(ref.entry) && size <= FRAG_SIZE)
+  {
+    if (readFragment(ref.entry, block))
+      return -1;
+    std::memset(block + std::min(size, old_size), 0, FRAG_SIZE - std::min(size, old_size));
+    if (writeFragment(ref.entry, block))
+      return -1;
+  }
+  else
+  {
+    // Too big for a fragment, the file gets blocks of its own first, a
+    // shared or compressed chain is copied before it is changed
+    if (detachFile(ref))
+      return -1;
+
+    std::vector<unsigned> chain = getChain(getFirstBlock(ref.entry));
+    unsigned no_blocks = size / BLOCK_SIZE + 1;
+
+    if (no_blocks < chain.size())
+    {
+      freeChain(chain[no_blocks]);
+      chain.resize(no_blocks);
+    }
+    if (sb.version == 1 && no_blocks > chain.size())
+    {
+      if (extendChain(chain.back(), no_blocks - chain.size()) == -1)
+        return -1;
+    }
+    else
+      setFAT(chain.back(), no_blocks > chain.size() ? FAT_HOLE : FAT_EOF);
+
+    // Clear what is left of the old data in the new last block, unless it
+    // is in the hole
+    if (size < old_size && no_blocks == chain.size())
+    {
+      unsigned last = chain[no_blocks - 1];
+      if (cache.read(last, block))
+        return -1;
+      std::memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+      cache.write(last, block);
+    }
+  }
+
+  ref.entry.size = size;
+  if (updateEntry(ref))
+    return -1;
+  writeFAT();
+
+  // The blocks cached by the descriptors of the file may be gone
+  resetOpenFiles(ref);
+  return 0;
+}
+
+// gives the sparse file at ref zeroed blocks for its hole up to no_blocks
+// blocks from its start, the rest of the hole is kept. The file must have
+// a chain of its own.
+int FS::fillHole(file_ref &ref, unsigned no_blocks)
+{
+  if (isPacked(ref.entry))
+    return 0;
+  const std::vector<unsigned> &chain = getBlockMap(getFirstBlock(ref.entry));
+  unsigned tail = chain.back(), length = chain.size();
+  if (fat[tail] != FAT_HOLE || no_blocks <= length)
+    return 0;
+
+  int last = extendChain(tail, no_blocks - length);
+  if (last == -1)
+    return -1;
+  if (no_blocks < ref.entry.size / BLOCK_SIZE + 1)
+    setFAT(last, FAT_HOLE);
+  return writeFAT();
+}
+
+// links count zeroed blocks after tail, the last block of a chain, and
+// returns the last of them. If the disk is full or the blocks cannot be
+// zeroed, -1 is returned and the chain is left as it was.
+int FS::extendChain(unsigned tail, unsigned count)
+{
+  if (getNoFreeBlocks() < count)
+  {
+    std::cout << "Not enough free blocks on disk" << std::endl;
+    return -1;
+  }
+  int tail_next = fat[tail];
+  updateFAT(tail, count);
+
+  // The new blocks are zeroed, IO_BATCH blocks at a time
+  std::vector<unsigned> added = getChain(fat[tail]);
+  std::vector<uint8_t> zeros(IO_BATCH * BLOCK_SIZE, 0);
+  for (unsigned i = 0; i < added.size(); i += IO_BATCH)
+  {
+    std::vector<unsigned> batch(added.begin() + i, added.begin() + std::min<size_t>(i + IO_BATCH, added.size()));
+    if (cache.write_blocks(batch, zeros.data()))
+    {
+      freeChain(added.front());
+      setFAT(tail, tail_next);
+      writeFAT();
+      return -1;
+    }
+  }
+  return added.back();
+}
+
+// makes the descriptors open on ref forget the blocks they have cached,
+// called when the chain of the file has changed
+void FS::resetOpenFiles(const file_ref &ref)
+{
+  for (auto &file : open_files)
+  {
+    if (!file.mode || file.ref.dir_block != ref.dir_block || file.ref.index != ref.index)
+      continue;
+    file.ref.entry = ref.entry;
+    file.first_blk = getFirstBlock(ref.entry);
+    file.cur_index = 0;
+    file.cur_block = file.first_blk;
+    file.chunks.clear();
+  }
+}
+
+// points the descriptors open on from at to, or marks them removed if to
+// is null. Called when a file is renamed, moved or removed.
+void FS::moveOpenFiles(const file_ref &from, const file_ref *to)
+{
+  for (auto &file : open_files)
+  {
+    if (!file.mode || file.ref.dir_block != from.dir_block || file.ref.index != from.index)
+      continue;
+    if (to)
+      file.ref = *to;
+    else
+      file.ref.entry.type = TYPE_EMPTY;
+  }
+}
+
+// longest file name that fits in a dir_entry
+unsigned FS::maxNameLength()
+{
+  return sb.version == 1 ? 55 : 53;
+}
+
+// sets a FAT entry, marks its FAT block dirty and keeps free_map in sync
+void FS::setFAT(unsigned block_no, int32_t value)
+{
+  if (fat[block_no] == value)
+    return;
+
+  // The chain this block is part of changes, its block map is stale
+  auto owner = block_owner.find(block_no);
+  if (owner != block_owner.end())
+    invalidateBlockMap(owner->second);
+
+  fat[block_no] = value;
+  fat_dirty[sb.version == 1 ? 0 : block_no / FAT_ENTRIES] = true;
+  if (block_no < data_start)
+    return;
+  if (value == FAT_FREE)
+    free_map.set_free(block_no);
+  else
+    free_map.set_used(block_no);
+}
+
+// builds free_map from the FAT, only the data blocks can be free
+void FS::rebuildFreeMap()
+{
+  free_map.reset(sb.no_blocks);
+  for (unsigned i = data_start; i < sb.no_blocks; i++)
+  {
+    if (fat[i] == FAT_FREE)
+      free_map.set_free(i);
+  }
+}
+
+// frag prints how fragmented the files and the free space are
+int FS::frag()
+{
+  std::vector<file_ref> files;
+  collectFiles(ROOT_BLOCK, files);
+
+  // A fragment block holds several packed files and a copied chain is
+  // shared by several files, each of them is counted once
+  std::set<unsigned> chains;
+  unsigned long no_blocks = 0, no_extents = 0, fragmented = 0;
+  for (auto &file : files)
+  {
+    if (!chains.insert(getFirstBlock(file.entry)).second)
+      continue;
+    std::vector<extent> extents = getExtents(getFirstBlock(file.entry));
+    for (auto &run : extents)
+      no_blocks += run.length;
+    no_extents += extents.size();
+    if (extents.size() > 1)
+      fragmented++;
+  }
+
+  extent largest = {0, 0};
+  std::vector<extent> longest = free_map.longest_runs(1);
+  if (!longest.empty())
+    largest = longest.front();
+
+  std::cout << "files:            " << files.size() << std::endl;
+  std::cout << "fragmented files: " << fragmented << std::endl;
+  std::cout << "file blocks:      " << no_blocks << std::endl;
+  std::cout << "extents:          " << no_extents << std::endl;
+  std::cout << "extents per file: " << std::fixed << std::setprecision(2)
+            << (chains.size() ? (double)no_extents / chains.size() : 0.0) << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+  std::cout << "free blocks:      " << free_map.get_no_free() << " in " << free_map.get_no_runs()
+            << " runs, largest " << largest.length << std::endl;
+  return 0;
+}
+
+// defrag [budget] moves fragmented files into contiguous runs, at most
+// budget blocks are moved per call so it can be run in small steps
+int FS::defragment(unsigned budget)
+{
+  std::vector<file_ref> files;
+  collectFiles(ROOT_BLOCK, files);
+
+  unsigned moved = 0, moved_files = 0, left = 0;
+  for (auto &file : files)
+  {
+    // A shared chain is left where it is, only one of its files would see
+    // the move
+    std::vector<extent> extents = getExtents(getFirstBlock(file.entry));
+    if (extents.size() < 2 || isShared(getFirstBlock(file.entry)))
+      continue;
+
+    unsigned size = 0;
+    for (auto &run : extents)
+      size += run.length;
+
+    // Always move at least one file per call, so every call makes progress
+    if (moved && moved + size > budget)
+    {
+      left++;
+      continue;
+    }
+
+    // Only move the file if the new blocks form fewer runs
+    std::vector<unsigned> blocks = allocateBlocks(size, 0);
+    unsigned new_extents = blocks.empty() ? 0 : 1;
+    for (unsigned i = 1; i < blocks.size(); i++)
+      if (blocks[i] != blocks[i - 1] + 1)
+        new_extents++;
+    if (blocks.empty() || new_extents >= extents.size())
+    {
+      left++;
+      continue;
+    }
+
+    if (relocateFile(file, blocks))
+    {
+      writeFAT();
+      std::cout << "Could not move " << file.entry.file_name << std::endl;
+      return -1;
+    }
+    moved += size;
+    moved_files++;
+    if (new_extents > 1)
+      left++;
+  }
+
+  writeFAT();
+
+  std::cout << "moved " << moved << " blocks in " << moved_files << " files, "
+            << left << " fragmented files left" << std::endl;
+  return 0;
+}
+
+// du [dirpath] prints the space used below every directory in <dirpath>
+int FS::du(std::string dirpath)
+{
+  unsigned dir_block;
+  std::string path;
+  if (resolveDir(dirpath, dir_block, path))
+    return -1;
+
+  std::vector<walk_dir> dirs = walkTree(dir_block, path);
+
+  // Sub-directories come after their parent, so adding up backwards gives
+  // the total of every subtree
+  std::vector<uint64_t> totals(dirs.size());
+  for (unsigned i = dirs.size(); i-- > 0;)
+  {
+    totals[i] += dirs[i].used;
+    for (int sub : dirs[i].subdirs)
+      if (sub != -1)
+        totals[i] += totals[sub];
+  }
+
+  visitTree(dirs, nullptr, [&](unsigned dir)
+            { std::cout << (totals[dir] + 1023) / 1024 << "\t" << dirs[dir].path << std::endl; });
+  return 0;
+}
+
+// find <name> prints the path of every file and directory named <name>
+// below the current directory
+int FS::find(std::string name)
+{
+  std::vector<walk_dir> dirs = walkTree(cwd, cwd_path.empty() ? getPath(cwd) : cwd_path);
+
+  visitTree(dirs, [&](unsigned dir, unsigned entry)
+            {
+              if (dirs[dir].entries[entry].name != name)
+                return;
+              std::string &path = dirs[dir].path;
+              std::cout << (path == "/" ? "" : path) << "/" << name << std::endl; },
+            nullptr);
+  return 0;
+}
+
+// tree [dirpath] prints all files and directories below <dirpath>
+int FS::tree(std::string dirpath)
+{
+  unsigned dir_block;
+  std::string path;
+  if (resolveDir(dirpath, dir_block, path))
+    return -1;
+
+  std::vector<walk_dir> dirs = walkTree(dir_block, path);
+  unsigned no_dirs = 0, no_files = 0;
+
+  std::cout << path << std::endl;
+  visitTree(dirs, [&](unsigned dir, unsigned entry)
+            {
+              const file_stat &st = dirs[dir].entries[entry];
+              std::cout << std::string(2 * (dirs[dir].depth + 1), ' ') << st.name;
+              if (st.type == TYPE_DIR)
+              {
+                std::cout << "/";
+                no_dirs++;
+              }
+              else
+                no_files++;
+              std::cout << std::endl; },
+            nullptr);
+  std::cout << no_dirs << " directories, " << no_files << " files" << std::endl;
+  return 0;
+}
+
+int FS::findFirstFreeBlock()
+{
+  return free_map.find_free();
+}
+
+int FS::getNoFreeBlocks()
+{
+  return free_map.get_no_free();
+}
+
+// returns the name index of the directory starting at dir_block, it is
+// built from the directory blocks on first use and kept up to date by
+// addEntry, updateEntry and removeEntry. Returns nullptr, with no index
+// built, if a block of the directory cannot be read.
+dir_index *FS::getDirIndex(unsigned dir_block)
+{
+  auto it = dir_indexes.find(dir_block);
+  if (it != dir_indexes.end())
+    return &it->second;
+
+  std::vector<unsigned> blocks = getChain(dir_block);
+  if (indexed_slots + blocks.size() * DIR_ENTRIES > DIR_INDEX_SLOTS)
+    clearDirIndexes();
+
+  dir_index &index = dir_indexes[dir_block];
+  dir_entry entries[DIR_ENTRIES] = {};
+  for (unsigned block : blocks)
+  {
+    if (cache.read(block, (uint8_t *)entries))
+    {
+      dir_indexes.erase(dir_block);
+      return nullptr;
+    }
+    for (unsigned k = 0; k < DIR_ENTRIES; k++)
+    {
+      if (entries[k].type != TYPE_EMPTY)
+        index.names.emplace(getName(entries[k]), file_ref{dir_block, block, k, entries[k]});
+      else if (block != dir_block || k != 0) // slot 0 is kept for ".." or "/"
+        index.free_slots.insert({block, k});
+    }
+  }
+  index.blocks = std::move(blocks);
+  indexed_slots += index.blocks.size() * DIR_ENTRIES;
+  return &index;
+}
+
+// drops the name index of the directory starting at dir_block
+void FS::dropDirIndex(unsigned dir_block)
+{
+  auto it = dir_indexes.find(dir_block);
+  if (it == dir_indexes.end())
+    return;
+  indexed_slots -= it->second.blocks.size() * DIR_ENTRIES;
+  dir_indexes.erase(it);
+}
+
+void FS::clearDirIndexes()
+{
+  dir_indexes.clear();
+  indexed_slots = 0;
+}
+
+// resolves name in the directory starting at dir_block through the dentry
+// cache, returns -1 if there is no such name. Misses are cached too, and
+// ".." is cached as the parent directory.
+int FS::lookupDentry(unsigned dir_block, const std::string &name, dentry &de)
+{
+  auto dir = dentries.find(dir_block);
+  if (dir != dentries.end())
+  {
+    auto it = dir->second.find(name);
+    if (it != dir->second.end())
+    {
+      de = it->second;
+      return de.first_blk == -1 ? -1 : 0;
+    }
+  }
+
+  if (no_dentries >= DENTRY_CACHE_SIZE)
+    clearDentries();
+
+  // A directory that cannot be read is not cached, the lookup is retried
+  file_ref ref;
+  int found = 0;
+  if (name == "..")
+  {
+    int parent = getParent(dir_block);
+    if (parent == -1)
+      return -1;
+    de = {parent, TYPE_DIR, READ | WRITE | EXECUTE};
+  }
+  else if ((found = findEntry(dir_block, name, ref)) == 0)
+  {
+    de = {(int)getFirstBlock(ref.entry), ref.entry.type, ref.entry.access_rights};
+    cacheInode(ref);
+  }
+  else if (found == -2)
+    return -1;
+  else
+    de = {-1, TYPE_EMPTY, 0};
+  dentries[dir_block][name] = de;
+  no_dentries++;
+  return de.first_blk == -1 ? -1 : 0;
+}
+
+// forgets the cached lookup of name in the directory starting at dir_block
+void FS::invalidateDentry(unsigned dir_block, const std::string &name)
+{
+  auto dir = dentries.find(dir_block);
+  if (dir != dentries.end())
+    no_dentries -= dir->second.erase(name);
+}
+
+// forgets every cached lookup in the directory starting at dir_block
+void FS::dropDentries(unsigned dir_block)
+{
+  auto dir = dentries.find(dir_block);
+  if (dir == dentries.end())
+    return;
+  no_dentries -= dir->second.size();
+  dentries.erase(dir);
+}
+
+void FS::clearDentries()
+{
+  dentries.clear();
+  no_dentries = 0;
+}
+
+// remembers name, parent and access rights of the directory ref points at
+void FS::cacheInode(const file_ref &ref)
+{
+  std::string name = getName(ref.entry);
+  if (ref.entry.type != TYPE_DIR || name == "..")
+    return;
+  inode &node = inodes[getFirstBlock(ref.entry)];
+  if (node.name != name || node.parent != ref.dir)
+    cwd_path.clear(); // it may be above cwd
+  node = {name, ref.dir, ref.entry.access_rights};
+}
+
+// forgets the directory ref points at, unless it has been linked elsewhere
+void FS::dropInode(const file_ref &ref)
+{
+  auto it = inodes.find(getFirstBlock(ref.entry));
+  if (it != inodes.end() && it->second.parent == ref.dir && it->second.name == getName(ref.entry))
+  {
+    inodes.erase(it);
+    cwd_path.clear();
+  }
+}
+
+// returns the metadata of the directory starting at dir_block, it is
+// looked up in the parent directory if it is not in inodes yet. Returns
+// nullptr if the parent has no entry for it.
+inode *FS::getInode(unsigned dir_block)
+{
+  auto it = inodes.find(dir_block);
+  if (it != inodes.end())
+    return &it->second;
+
+  int parent = getParent(dir_block);
+  std::vector<file_ref> refs;
+  if (parent == -1 || listDir(parent, refs))
+    return nullptr;
+  for (auto &ref : refs)
+    if (getFirstBlock(ref.entry) == dir_block && getName(ref.entry) != "..")
+    {
+      cacheInode(ref);
+      return &inodes[dir_block];
     }
+  return nullptr;
+}
 
-    if (filepath[i] == "..")
+// builds the absolute path of the directory starting at dir_block by
+// following the parents in inodes up to the root
+std::string FS::getPath(unsigned dir_block)
+{
+  std::string path = "";
+  while (dir_block != ROOT_BLOCK)
+  {
+    inode *node = getInode(dir_block);
+    if (!node)
+      break;
+    path = "/" + node->name + path;
+    dir_block = node->parent;
+  }
+
+  if (path.empty())
+    path = "/";
+  return path;
+}
+
+// looks up name in the directory starting at dir_block, returns -1 if
+// there is no such entry and -2 if the directory cannot be read
+int FS::findEntry(unsigned dir_block, const std::string &name, file_ref &ref)
+{
+  dir_index *index = getDirIndex(dir_block);
+  if (!index)
+    return -2;
+  auto it = index->names.find(name);
+  if (it == index->names.end())
+    return -1;
+  ref = it->second;
+  return 0;
+}
+
+// sets refs to the entries of the directory starting at dir_block, in the
+// order they are stored. Returns -1 if the directory cannot be read.
+int FS::listDir(unsigned dir_block, std::vector<file_ref> &refs)
+{
+  refs.clear();
+  dir_index *index = getDirIndex(dir_block);
+  if (!index)
+    return -1;
+  dir_entry entries[DIR_ENTRIES] = {};
+  for (unsigned block : index->blocks)
+  {
+    if (cache.read(block, (uint8_t *)entries))
+      return -1;
+    for (unsigned k = 0; k < DIR_ENTRIES; k++)
+      if (entries[k].type != TYPE_EMPTY)
+        refs.push_back({dir_block, block, k, entries[k]});
+  }
+  return 0;
+}
+
+// puts de in the first empty slot of the directory starting at dir_block.
+// A full directory grows by one block on v2 volumes, v1 directories stay
+// one block so the old tools can still read them.
+int FS::addEntry(unsigned dir_block, const dir_entry &de)
+{
+  dir_index *dir = getDirIndex(dir_block);
+  if (!dir)
+    return -1;
+  dir_index &index = *dir;
+  if (index.free_slots.empty())
+  {
+    unsigned tail = index.blocks.back();
+    if (sb.version == 1)
+      return -1;
+    updateFAT(tail, 1);
+    if (fat[tail] == FAT_EOF)
+      return -1;
+    if (initDirBlock(fat[tail], nullptr))
     {
-      temp = working_directory[0].first_blk;
-      disk.read(temp, (uint8_t *)working_directory);
-      continue;
+      // The new block is not usable, the directory keeps its old chain
+      freeChain(fat[tail]);
+      setFAT(tail, FAT_EOF);
+      writeFAT();
+      return -1;
     }
 
-    bool dir_found = false;
-    bool execute = false;
-    for (auto &dir : working_directory)
+    index.blocks.push_back(fat[tail]);
+    for (unsigned k = 0; k < DIR_ENTRIES; k++)
+      index.free_slots.insert({(unsigned)fat[tail], k});
+    indexed_slots += DIR_ENTRIES;
+  }
+
+  auto slot = index.free_slots.begin();
+  file_ref ref = {dir_block, slot->first, slot->second, de};
+  if (writeEntry(ref))
+    return -1;
+  index.free_slots.erase(slot);
+  index.names.emplace(getName(de), ref);
+  invalidateDentry(dir_block, getName(de));
+  cacheInode(ref);
+  return 0;
+}
+
+// writes ref.entry back to its slot, the entry may have a new name
+int FS::updateEntry(const file_ref &ref)
+{
+  dir_index *dir = getDirIndex(ref.dir);
+  if (!dir)
+    return -1;
+  dir_index &index = *dir;
+  dir_entry entries[DIR_ENTRIES];
+  if (cache.read(ref.dir_block, (uint8_t *)entries))
+    return -1;
+  file_ref old = ref;
+  old.entry = entries[ref.index];
+  std::string old_name = getName(old.entry);
+  entries[ref.index] = ref.entry;
+  if (cache.write(ref.dir_block, (uint8_t *)entries))
+    return -1;
+
+  index.names.erase(old_name);
+  index.names[getName(ref.entry)] = ref;
+  invalidateDentry(ref.dir, old_name);
+  invalidateDentry(ref.dir, getName(ref.entry));
+  dropInode(old);
+  cacheInode(ref);
+  return 0;
+}
+
+// marks the slot of ref empty so it can be reused
+int FS::removeEntry(const file_ref &ref)
+{
+  dir_index *dir = getDirIndex(ref.dir);
+  if (!dir)
+    return -1;
+  dir_index &index = *dir;
+  file_ref empty = ref;
+  empty.entry.type = TYPE_EMPTY;
+  if (writeEntry(empty))
+    return -1;
+
+  index.names.erase(getName(ref.entry));
+  index.free_slots.insert({ref.dir_block, ref.index});
+  invalidateDentry(ref.dir, getName(ref.entry));
+  dropInode(ref);
+  return 0;
+}
+
+// writes ref.entry to its slot without touching the name index
+int FS::writeEntry(const file_ref &ref)
+{
+  dir_entry entries[DIR_ENTRIES];
+  if (cache.read(ref.dir_block, (uint8_t *)entries))
+    return -1;
+  entries[ref.index] = ref.entry;
+  return cache.write(ref.dir_block, (uint8_t *)entries);
+}
+
+// fills block_no with empty dir_entries, with first in slot 0 if given
+int FS::initDirBlock(unsigned block_no, const dir_entry *first)
+{
+  dir_entry entries[DIR_ENTRIES];
+  std::memset(entries, 0, sizeof(entries));
+  for (auto &de : entries)
+    de.type = TYPE_EMPTY;
+  if (first)
+    entries[0] = *first;
+  return cache.write(block_no, (uint8_t *)entries);
+}
+
+file_stat FS::toStat(const dir_entry &de)
+{
+  return {getName(de), de.size, getFirstBlock(de), de.type, getRights(de)};
+}
+
+// returns the first block of the parent directory, root is its own parent
+int FS::getParent(unsigned dir_block)
+{
+  dir_entry entries[DIR_ENTRIES];
+  if (cache.read(dir_block, (uint8_t *)entries))
+    return -1;
+  return getFirstBlock(entries[0]);
+}
+
+// links size newly allocated blocks after block_start, the last block of
+// a chain. The new blocks continue right after block_start if possible.
+void FS::updateFAT(int block_start, uint32_t size)
+{
+  std::vector<unsigned> blocks = allocateBlocks(size, block_start + 1);
+  for (unsigned block : blocks)
+  {
+    setFAT(block_start, block);
+    block_start = block;
+  }
+  if (!blocks.empty())
+    setFAT(block_start, FAT_EOF);
+}
+
+// allocates a new chain of size blocks, returns its first block or -1 if
+// there are not enough free blocks
+int FS::allocateChain(uint32_t size)
+{
+  std::vector<unsigned> blocks = allocateBlocks(size, 0);
+  if (blocks.empty())
+    return -1;
+
+  for (unsigned i = 0; i + 1 < blocks.size(); i++)
+    setFAT(blocks[i], blocks[i + 1]);
+  setFAT(blocks.back(), FAT_EOF);
+
+  return blocks.front();
+}
+
+// frees every block of the chain starting at first_blk
+void FS::freeChain(unsigned first_blk)
+{
+  int current_block = first_blk, next_block;
+  do
+  {
+    next_block = fat[current_block];
+    setFAT(current_block, FAT_FREE);
+    current_block = next_block;
+  } while (current_block != FAT_EOF && current_block != FAT_HOLE && current_block != FAT_FREE);
+}
+
+// picks size free blocks in the order they should be chained, without
+// changing the FAT. The blocks are taken from the run starting at goal if
+// it is long enough, else from the smallest run that holds all of them,
+// else from as few runs as possible. Returns no blocks if the disk is full.
+std::vector<unsigned> FS::allocateBlocks(uint32_t size, unsigned goal)
+{
+  std::vector<unsigned> blocks;
+  if (size == 0 || size > free_map.get_no_free())
+    return blocks;
+
+  std::vector<extent> chosen;
+  if (goal >= data_start && free_map.run_length(goal, size) == size)
+  {
+    chosen.push_back({goal, size});
+  }
+  else if (size == 1)
+  {
+    chosen.push_back({(unsigned)free_map.find_free(), 1});
+  }
+  else
+  {
+    // Best fit: the smallest run that is long enough
+    extent best;
+    if (free_map.best_fit(size, best))
+    {
+      chosen.push_back({best.start, size});
+    }
+    else
     {
-      if (dir.file_name == filepath[i] && dir.type == TYPE_FILE)
+      // Fewest runs: take the longest runs first, then lay them out in
+      // block order so the file is read front to back
+      uint32_t remaining = size;
+      for (auto &run : free_map.longest_runs(size))
       {
-        if (std::string(dir.file_name) == filepath.back() && i == filepath.size() - 1) // last element
-          return temp;
-        return -1;
+        unsigned length = std::min<uint32_t>(run.length, remaining);
+        chosen.push_back({run.start, length});
+        remaining -= length;
       }
-      if (dir.file_name == filepath[i] && dir.type == TYPE_DIR)
-      {
-        temp = dir.first_blk;
-        dir_found = true;
+      std::sort(chosen.begin(), chosen.end(), [](const extent &a, const extent &b)
+                { return a.start < b.start; });
+    }
+  }
 
-        if ((dir.access_rights & EXECUTE) == EXECUTE)
-          execute = true;
+  for (auto &run : chosen)
+    for (unsigned i = 0; i < run.length; i++)
+      blocks.push_back(run.start + i);
+  return blocks;
+}
 
-        break;
+// returns the runs of adjacent blocks that make up the chain at first_blk
+std::vector<extent> FS::getExtents(int first_blk)
+{
+  std::vector<extent> extents;
+  for (unsigned block : getBlockMap(first_blk))
+  {
+    if (!extents.empty() && extents.back().start + extents.back().length == block)
+      extents.back().length++;
+    else
+      extents.push_back({block, 1});
+  }
+  return extents;
+}
+
+// appends every file below dir_block, and where its dir_entry is, to
+// files. A directory that cannot be read is skipped.
+void FS::collectFiles(unsigned dir_block, std::vector<file_ref> &files)
+{
+  std::vector<file_ref> refs;
+  listDir(dir_block, refs);
+  for (auto &ref : refs)
+  {
+    std::string name = getName(ref.entry);
+    if (ref.entry.type == TYPE_FILE)
+      files.push_back(ref);
+    else if (ref.entry.type == TYPE_DIR && name != ".." && name != "/")
+      collectFiles(getFirstBlock(ref.entry), files);
+  }
+}
+
+// reads the directory tree below dir_block, path is the path of dir_block.
+// The tree is read a level at a time: the blocks of every directory on a
+// level are read together in IO_BATCH batches, then the directories are
+// parsed on the worker pool. The reads stay on the calling thread, as the
+// block cache is not shared between threads, so only the parsing is spread
+// over the pool. A directory whose blocks cannot be read is reported and
+// left empty. Returns the directories in breadth first order, dir_block
+// first.
+std::vector<walk_dir> FS::walkTree(unsigned dir_block, const std::string &path)
+{
+  std::vector<walk_dir> dirs(1);
+  dirs[0].block = dir_block;
+  dirs[0].depth = 0;
+  dirs[0].path = path;
+  std::unordered_map<unsigned, bool> seen = {{dir_block, true}}; // a corrupt tree could loop
+
+  for (size_t level = 0; level < dirs.size();)
+  {
+    size_t level_end = dirs.size();
+
+    // The blocks of every directory on this level, first[i] is where the
+    // blocks of dirs[level + i] start
+    std::vector<unsigned> blocks;
+    std::vector<size_t> first;
+    for (size_t i = level; i < level_end; i++)
+    {
+      first.push_back(blocks.size());
+      std::vector<unsigned> chain = getChain(dirs[i].block);
+      blocks.insert(blocks.end(), chain.begin(), chain.end());
+    }
+    first.push_back(blocks.size());
+
+    std::vector<dir_entry> entries(blocks.size() * DIR_ENTRIES);
+    std::vector<bool> unread(blocks.size(), false);
+    for (size_t i = 0; i < blocks.size(); i += IO_BATCH)
+    {
+      std::vector<unsigned> batch(blocks.begin() + i, blocks.begin() + std::min<size_t>(i + IO_BATCH, blocks.size()));
+      if (cache.read_blocks(batch, (uint8_t *)&entries[i * DIR_ENTRIES]))
+        std::fill(unread.begin() + i, unread.begin() + i + batch.size(), true);
+    }
+
+    // A directory with a block that was not read is not parsed, zeroed
+    // entries would read as files
+    std::vector<bool> skip(level_end - level, false);
+    for (size_t i = 0; i < level_end - level; i++)
+    {
+      if (std::find(unread.begin() + first[i], unread.begin() + first[i + 1], true) == unread.begin() + first[i + 1])
+        continue;
+      skip[i] = true;
+      std::cout << "Could not read directory " << dirs[level + i].path << std::endl;
+    }
+
+    // Parsing only reads entries and the FAT, so the directories can be
+    // handled by different threads
+    std::function<void(unsigned)> parse = [&](unsigned i)
+    {
+      walk_dir &dir = dirs[level + i];
+      dir.used = (uint64_t)(first[i + 1] - first[i]) * BLOCK_SIZE;
+      if (skip[i])
+        return;
+      for (size_t k = first[i] * DIR_ENTRIES + 1; k < first[i + 1] * DIR_ENTRIES; k++)
+      {
+        const dir_entry &de = entries[k];
+        if (de.type == TYPE_EMPTY)
+          continue;
+        dir.entries.push_back(toStat(de));
+        if (de.type == TYPE_FILE && isPacked(de))
+          dir.used += FRAG_SIZE;
+        else if (de.type == TYPE_FILE)
+          dir.used += (uint64_t)getChain(getFirstBlock(de)).size() * BLOCK_SIZE;
+      }
+    };
+    if (blocks.size() < WALK_PARALLEL_BLOCKS)
+      for (unsigned i = 0; i < level_end - level; i++)
+        parse(i);
+    else
+      pool.run(level_end - level, parse);
+
+    // Queue the sub-directories for the next level
+    for (size_t i = level; i < level_end; i++)
+    {
+      dirs[i].subdirs.assign(dirs[i].entries.size(), -1);
+      for (unsigned k = 0; k < dirs[i].entries.size(); k++)
+      {
+        const file_stat &st = dirs[i].entries[k];
+        if (st.type != TYPE_DIR || (st.access_rights & EXECUTE) != EXECUTE || seen[st.first_blk])
+          continue;
+        seen[st.first_blk] = true;
+        dirs[i].subdirs[k] = dirs.size();
+        walk_dir sub;
+        sub.block = st.first_blk;
+        sub.depth = dirs[i].depth + 1;
+        sub.path = (dirs[i].path == "/" ? "" : dirs[i].path) + "/" + st.name;
+        dirs.push_back(std::move(sub));
       }
     }
-    if (!dir_found || !execute)
+    level = level_end;
+  }
+  return dirs;
+}
+
+// goes through the directories from walkTree depth first, on_entry is
+// called for every entry before the walk descends into it and on_leave for
+// every directory after all its entries. Either may be empty.
+void FS::visitTree(const std::vector<walk_dir> &dirs,
+                   const std::function<void(unsigned dir, unsigned entry)> &on_entry,
+                   const std::function<void(unsigned dir)> &on_leave)
+{
+  // directory and next entry to visit in it
+  std::vector<std::pair<unsigned, unsigned>> stack = {{0, 0}};
+  while (!stack.empty())
+  {
+    unsigned dir = stack.back().first;
+    unsigned entry = stack.back().second++;
+    if (entry == dirs[dir].entries.size())
+    {
+      if (on_leave)
+        on_leave(dir);
+      stack.pop_back();
+      continue;
+    }
+    if (on_entry)
+      on_entry(dir, entry);
+    if (dirs[dir].subdirs[entry] != -1)
+      stack.push_back({dirs[dir].subdirs[entry], 0});
+  }
+}
+
+// finds the directory <dirpath> for du and tree
+int FS::resolveDir(std::string dirpath, unsigned &dir_block, std::string &path)
+{
+  file_stat st;
+  if (stat(dirpath, st))
+    return -1;
+  if (st.type != TYPE_DIR)
+  {
+    std::cout << dirpath << " is not a directory" << std::endl;
+    return -1;
+  }
+  dir_block = st.first_blk;
+  path = getPath(dir_block);
+  return 0;
+}
+
+// copies the data of a file to blocks, links them into a new chain, points
+// the dir_entry at it and frees the old chain
+int FS::relocateFile(const file_ref &file, const std::vector<unsigned> &blocks)
+{
+  std::vector<unsigned> chain = getChain(getFirstBlock(file.entry));
+  std::vector<uint8_t> data(IO_BATCH * BLOCK_SIZE);
+
+  for (unsigned i = 0; i < chain.size(); i += IO_BATCH)
+  {
+    unsigned end = std::min<size_t>(i + IO_BATCH, chain.size());
+    std::vector<unsigned> from(chain.begin() + i, chain.begin() + end);
+    std::vector<unsigned> to(blocks.begin() + i, blocks.begin() + end);
+    if (cache.read_blocks(from, data.data()) || cache.write_blocks(to, data.data()))
+      return -1;
+  }
+
+  for (unsigned i = 0; i + 1 < blocks.size(); i++)
+    setFAT(blocks[i], blocks[i + 1]);
+  setFAT(blocks.back(), fat[chain.back()]); // FAT_HOLE if the file is sparse
+
+  file_ref moved = file;
+  setFirstBlock(moved.entry, blocks.front());
+  if (updateEntry(moved))
+    return -1;
+  moveHash(chain.front(), blocks.front());
+
+  for (unsigned block : chain)
+    setFAT(block, FAT_FREE);
+  return 0;
+}
+
+// returns the block map of the file starting at first_blk, it is built
+// from the FAT on first use and kept until the chain changes
+const std::vector<unsigned> &FS::getBlockMap(unsigned first_blk)
+{
+  auto it = block_maps.find(first_blk);
+  if (it != block_maps.end())
+    return it->second;
+
+  std::vector<unsigned> chain = getChain(first_blk);
+  if (block_owner.size() + chain.size() > BLOCK_MAP_BLOCKS)
+    clearBlockMaps();
+  for (unsigned block : chain)
+  {
+    auto owner = block_owner.find(block);
+    if (owner != block_owner.end() && owner->second != first_blk)
+      invalidateBlockMap(owner->second);
+    block_owner[block] = first_blk;
+  }
+  return block_maps[first_blk] = std::move(chain);
+}
+
+// drops the block map of the file starting at first_blk
+void FS::invalidateBlockMap(unsigned first_blk)
+{
+  auto it = block_maps.find(first_blk);
+  if (it == block_maps.end())
+    return;
+  for (unsigned block : it->second)
+    block_owner.erase(block);
+  block_maps.erase(it);
+}
+
+void FS::clearBlockMaps()
+{
+  block_maps.clear();
+  block_owner.clear();
+}
+
+// returns the blocks of the FAT chain starting at first_blk, in file order
+std::vector<unsigned> FS::getChain(int first_blk)
+{
+  std::vector<unsigned> chain;
+  for (int block = first_blk; block != FAT_EOF && block != FAT_HOLE; block = fat[block])
+  {
+    // a corrupt FAT could contain a loop
+    if (chain.size() >= sb.no_blocks)
+      break;
+    chain.push_back(block);
+  }
+  return chain;
+}
+
+std::vector<std::string> FS::interpretFilepath(std::string dirpath)
+{
+  std::vector<std::string> path_vec;
+  char delimiter = '/';
+  if (dirpath[0] == delimiter)
+    path_vec.push_back("/");
+
+  // Interpret string to determine the steps required
+  std::istringstream iss(dirpath);
+  std::string path;
+  while (std::getline(iss, path, delimiter))
+  {
+    if (path == ".") // We don't have to change cwd if we encounter '.'
+      continue;
+
+    if (path.length())
+      path_vec.push_back(path);
+    path = "";
+  }
+  return path_vec;
+}
+
+std::string FS::accessRightsToString(uint8_t access_rights)
+{
+  std::string rwx = "---";
+  std::string rwx_chars = "rwx";
+  uint8_t rights[3] = {READ, WRITE, EXECUTE};
+
+  for (int i = 0; i < rwx.length(); i++)
+  {
+    if ((access_rights & rights[i]) == rights[i])
+      rwx[i] = rwx_chars[i];
+  }
+
+  return rwx;
+}
+
+// returns the access rights of the directory starting at dir_block, they
+// are kept in its entry in the parent directory
+uint8_t FS::getDirAccessRights(int dir_block)
+{
+  inode *node = getInode(dir_block);
+  return node ? node->access_rights : 0;
+}
+
+int FS::traverseToDir(std::vector<std::string> filepath)
+{
+  int temp = cwd;
+
+  for (int i = 0; i < filepath.size(); i++)
+  {
+    if (filepath[i] == "/") // absolute path, start from ROOT_BLOCK
+    {
+      temp = ROOT_BLOCK;
+      continue;
+    }
+
+    dentry de;
+    if (lookupDentry(temp, filepath[i], de))
+      return -1;
+
+    if (filepath[i] == "..")
+    {
+      temp = de.first_blk;
+      continue;
+    }
+
+    if (de.type == TYPE_FILE)
     {
+      if (i == filepath.size() - 1) // last element
+        return temp;
       return -1;
     }
-    disk.read(temp, (uint8_t *)working_directory);
+    if (de.type != TYPE_DIR || (de.access_rights & EXECUTE) != EXECUTE)
+      return -1;
+    temp = de.first_blk;
   }
 
   return temp; // new cwd
@@ -2,17 +2,57 @@
 #include <iomanip>
 #include <sstream>
 #include <cstdint>
+#include <cstdio>
+#include <chrono>
 #include <cstring>
 #include <vector>
+#include <set>
+#include <unordered_map>
+#include <functional>
 #include "disk.h"
+#include "cache.h"
+#include "freemap.h"
+#include "pool.h"
+#include "lz.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
 #define ROOT_BLOCK 0
-#define FAT_BLOCK 1
+#define FAT_BLOCK 1   // v1: the FAT is a single block of 16-bit entries
+#define SUPER_BLOCK 1 // v2: the superblock, followed by a FAT of 32-bit entries
 #define FAT_FREE 0
 #define FAT_EOF -1
+#define FAT_HOLE -2 // ends the chain of a sparse file, see below
+
+#define FS_MAGIC 0x32534654 // "TFS2"
+#define FS_VERSION 2
+#define FAT_ENTRIES (BLOCK_SIZE / 4) // 32-bit FAT entries per block
+
+// number of blocks moved per read_blocks / write_blocks call in the data paths
+#define IO_BATCH 64
+
+// most blocks kept in the per-file block maps before they are dropped
+#define BLOCK_MAP_BLOCKS (1 << 20)
+
+// dir_entry slots per directory block
+#define DIR_ENTRIES (BLOCK_SIZE / 64)
+
+// most directory slots kept in the name indexes before they are dropped
+#define DIR_INDEX_SLOTS (1 << 20)
+
+// most names kept in the dentry cache before it is dropped
+#define DENTRY_CACHE_SIZE (1 << 16)
+
+// directory blocks on one level of a tree walk before it is parsed on the
+// worker pool instead of the calling thread
+#define WALK_PARALLEL_BLOCKS 16
+
+// size of the descriptor table used by open
+#define MAX_OPEN_FILES 64
+
+// default number of blocks defrag may move per call
+#define DEFRAG_BUDGET 256
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
@@ -20,48 +60,312 @@
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
+#define RIGHTS_MASK 0x07
+
+// tail packing, v2 only: a file of at most FRAG_SIZE bytes is kept in one
+// fragment of a block shared with other small files. first_blk is that
+// block and the fragment is kept in the upper bits of access_rights.
+#define FRAG_SIZE 512
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE)
+#define FLAG_PACKED 0x80
+#define FRAG_SLOT_SHIFT 3
+#define FRAG_SLOT_MASK 0x38
+
+// compressed files, v2 only: the chain of a file with FLAG_COMPRESSED holds
+// a compress_header, its data cut in CHUNK_SIZE chunks and compressed one
+// by one, then the chunk index: the offset of every chunk in the chain and
+// of the end of the last one. A chunk that does not get smaller is stored
+// as it is.
+#define FLAG_COMPRESSED 0x40
+#define CHUNK_SIZE (16 * BLOCK_SIZE)
+
+// sparse files: the chain of a file may end in FAT_HOLE instead of FAT_EOF.
+// The file then has fewer than size / BLOCK_SIZE + 1 blocks, the ones past
+// its chain are a hole that takes no space and reads as zeros. A file keeps
+// at least its first block, and the hole is filled when it is written.
+// Only v2 volumes have holes, a file on a v1 volume grows by zeroed blocks
+// so that the older tools can still read it.
+struct fs_options
+{
+  unsigned cache_blocks = CACHE_BLOCKS; // capacity of the block cache
+  disk_options disk;                    // backend used by the disk
+  unsigned walk_threads = 0;            // threads parsing directories in tree
+                                        // walks, 0 is one per cpu
+  bool dedup = false;                   // whole-file dedup: share the chain of
+                                        // a new file with an existing file of
+                                        // the same content
+  bool compress = false;                // compress the files that are created
+};
+
+struct superblock
+{                       // stored in SUPER_BLOCK on v2 volumes
+    uint32_t magic;      // FS_MAGIC
+    uint32_t version;    // FS_VERSION
+    uint32_t block_size; // bytes per block
+    uint32_t no_blocks;  // number of blocks in the volume
+    uint32_t fat_start;  // first block of the FAT
+    uint32_t fat_blocks; // number of blocks in the FAT
+    uint32_t dedup_start;   // first block of the dedup index, 0 if there is none
+    uint32_t dedup_entries; // number of dedup_entry in the dedup index
+};
+
+struct compress_header
+{                         // first bytes of the chain of a compressed file
+    uint32_t chunks;      // number of chunks
+    uint32_t index_start; // offset of the chunk index in the chain
+    uint32_t chunk_size;  // CHUNK_SIZE
+    uint32_t unused;
+};
+
+struct dedup_entry
+{                       // one file in the dedup index, stored on disk
+    uint64_t hash;      // hash of the blocks of the file
+    uint32_t first_blk; // first block of its chain
+    uint32_t unused;
+};
+
+#define DEDUP_ENTRIES (BLOCK_SIZE / sizeof(dedup_entry)) // dedup_entry per block
+
+// 64-bit FNV-1a, used to hash file content for dedup
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
 struct dir_entry
 {                          // size: 64 bytes
-    char file_name[56];    // name of the file / sub-directory
+    char file_name[56];    // name of the file / sub-directory, on v2 volumes the
+                           // last two bytes hold the upper 16 bits of first_blk
     uint32_t size;         // size of the file in bytes
     uint16_t first_blk;    // index in the FAT for the first block of the file
     uint8_t type;          // directory (1) or file (0)
-    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01), on
+                           // v2 volumes also FLAG_PACKED and the fragment
+};
+
+struct file_ref
+{
+    unsigned dir;       // first block of the directory holding the entry
+    unsigned dir_block; // directory block holding the entry
+    unsigned index;     // position of the entry in dir_block
+    dir_entry entry;
+};
+
+struct file_stat
+{                          // one entry as returned by readdir and stat
+    std::string name;
+    uint32_t size;
+    unsigned first_blk;
+    uint8_t type;
+    uint8_t access_rights;
+};
+
+struct dentry
+{                          // cached result of looking up a name in a directory
+    int first_blk;         // -1 if there is no such name
+    uint8_t type;
+    uint8_t access_rights;
+};
+
+struct inode
+{                          // cached metadata of a directory
+    std::string name;      // its name in the parent directory
+    unsigned parent;       // first block of the parent directory
+    uint8_t access_rights;
+};
+
+struct walk_dir
+{                                     // one directory found by walkTree
+    unsigned block;                   // first block of the directory
+    unsigned depth;                   // levels below the start of the walk
+    std::string path;
+    std::vector<file_stat> entries;   // everything but ".."
+    std::vector<int> subdirs;         // per entry, its walk_dir or -1
+    uint64_t used = 0;                // bytes allocated to it and its files
+};
+
+struct open_file
+{                          // one slot of the descriptor table
+    file_ref ref;          // the file, looked up again by name on every use
+    uint8_t mode;          // READ and/or WRITE, 0 if the slot is free
+    uint32_t pos;          // offset used by read and write, set by lseek
+    unsigned first_blk;    // chain that cur_index and cur_block are in
+    unsigned cur_index;    // position in the chain of the last block used
+    unsigned cur_block;
+    std::vector<uint32_t> chunks; // chunk index of a compressed file, read
+                                  // on first use
+};
+
+struct dir_index
+{                                     // in-memory index of one directory
+    std::vector<unsigned> blocks;     // the directory's chain
+    std::unordered_map<std::string, file_ref> names; // entries by file name
+    std::set<std::pair<unsigned, unsigned>> free_slots; // empty (block, index)
 };
 
 class FS
 {
 private:
     Disk disk;
+    BlockCache cache;
+    WorkerPool pool;
     int cwd = ROOT_BLOCK;
-    int16_t fat[BLOCK_SIZE / 2];
-    dir_entry working_directory[BLOCK_SIZE / 64];
+    std::string cwd_path = "/"; // path of cwd, empty if it has to be rebuilt
+    superblock sb;
+    unsigned data_start; // first block that can be allocated
+    std::vector<int32_t> fat; // resident FAT, read at mount
+    std::vector<bool> fat_dirty; // FAT blocks changed since the last writeFAT
+    FreeMap free_map; // free blocks in fat, rebuilt at mount
+    // block maps: the blocks of a file's chain in file order, keyed by its
+    // first block, and the first block of the map each block belongs to
+    std::unordered_map<unsigned, std::vector<unsigned>> block_maps;
+    std::unordered_map<unsigned, unsigned> block_owner;
+    // name indexes of the directories, keyed by their first block
+    std::unordered_map<unsigned, dir_index> dir_indexes;
+    unsigned long indexed_slots = 0;
+    // dentry cache used by traverseToDir, keyed by directory and name
+    std::unordered_map<unsigned, std::unordered_map<std::string, dentry>> dentries;
+    unsigned long no_dentries = 0;
+    // metadata of the directories seen so far, keyed by their first block
+    std::unordered_map<unsigned, inode> inodes;
+    // the fragments in use in every fragment block, found on first use,
+    // and the fragment blocks that have a free fragment
+    std::unordered_map<unsigned, uint8_t> frag_used;
+    std::set<unsigned> frag_partial;
+    bool frags_loaded = false;
+    // files sharing a chain after cp, keyed by its first block and counted
+    // on first use. Chains with a single file are not kept.
+    std::unordered_map<unsigned, unsigned> chain_refs;
+    bool refs_loaded = false;
+    // dedup index: chains by the hash of their content and the other way
+    // around, read from disk on first use and written back at sync. Dedup
+    // is whole-file: a FAT entry has one successor, so a block can only be
+    // shared as part of a whole chain. New files are looked up at create,
+    // append, pwrite and cp do not consult the index.
+    bool dedup;
+    std::unordered_map<uint64_t, unsigned> dedup_chains;
+    std::unordered_map<unsigned, uint64_t> dedup_hashes;
+    bool dedup_loaded = false;
+    bool dedup_dirty = false;
+    unsigned long dedup_lookups = 0;
+    unsigned long dedup_hits = 0;
+    unsigned long dedup_saved = 0;        // blocks given back by dedup hits
+    unsigned long dedup_verify_reads = 0; // blocks read to compare chains
+    std::chrono::nanoseconds dedup_time{0};
+    bool compress;
+    // descriptor table, indexed by file descriptor
+    std::vector<open_file> open_files;
 
+    int mount();
+    int readFAT();
+    int writeFAT();
+    void setFAT(unsigned block_no, int32_t value);
+    void rebuildFreeMap();
+    unsigned getFirstBlock(const dir_entry &de);
+    void setFirstBlock(dir_entry &de, unsigned block_no);
+    std::string getName(const dir_entry &de);
+    unsigned maxNameLength();
+    uint8_t getRights(const dir_entry &de);
+    bool canPack(const dir_entry &de);
+    bool isPacked(const dir_entry &de);
+    bool isCompressed(const dir_entry &de);
+    void loadFragments();
+    int allocateFragment(dir_entry &de);
+    void freeFragment(const dir_entry &de);
+    int readFragment(const dir_entry &de, uint8_t *buf);
+    int writeFragment(const dir_entry &de, const uint8_t *data);
+    void freeData(const dir_entry &de);
+    void loadRefs();
+    bool isShared(unsigned first_blk);
+    void refChain(unsigned first_blk);
+    unsigned unrefChain(unsigned first_blk);
+    int copyChain(unsigned first_blk);
+    int unshareFile(file_ref &ref);
+    void loadDedup();
+    int writeDedup();
+    void dropHash(unsigned first_blk);
+    void moveHash(unsigned from, unsigned to);
+    int dedupFile(dir_entry &de, uint64_t hash);
+    bool sameChain(unsigned first_a, unsigned first_b);
+    open_file *getFile(int fd, uint8_t mode);
+    int fileBlock(open_file &file, unsigned index);
+    int unpackFile(file_ref &ref);
+    int uncompressFile(file_ref &ref);
+    int detachFile(file_ref &ref);
+    int readChain(unsigned first_blk, uint64_t offset, uint32_t length, uint8_t *buf);
+    int loadChunks(const dir_entry &de, std::vector<uint32_t> &chunks);
+    int readChunk(const dir_entry &de, const std::vector<uint32_t> &chunks, unsigned i, uint8_t *buf);
+    int resizeFile(file_ref &ref, uint32_t size);
+    int fillHole(file_ref &ref, unsigned no_blocks);
+    int extendChain(unsigned tail, unsigned count);
+    void moveOpenFiles(const file_ref &from, const file_ref *to);
+    void resetOpenFiles(const file_ref &ref);
     int findFirstFreeBlock();
     int getNoFreeBlocks();
-    int createDirEntry(dir_entry *de, int dir_block);
+    dir_index *getDirIndex(unsigned dir_block);
+    void dropDirIndex(unsigned dir_block);
+    void clearDirIndexes();
+    int lookupDentry(unsigned dir_block, const std::string &name, dentry &de);
+    void invalidateDentry(unsigned dir_block, const std::string &name);
+    void dropDentries(unsigned dir_block);
+    void clearDentries();
+    void cacheInode(const file_ref &ref);
+    void dropInode(const file_ref &ref);
+    inode *getInode(unsigned dir_block);
+    std::string getPath(unsigned dir_block);
+    file_stat toStat(const dir_entry &de);
+    std::vector<walk_dir> walkTree(unsigned dir_block, const std::string &path);
+    void visitTree(const std::vector<walk_dir> &dirs,
+                   const std::function<void(unsigned dir, unsigned entry)> &on_entry,
+                   const std::function<void(unsigned dir)> &on_leave);
+    int resolveDir(std::string dirpath, unsigned &dir_block, std::string &path);
+    int findEntry(unsigned dir_block, const std::string &name, file_ref &ref);
+    int listDir(unsigned dir_block, std::vector<file_ref> &refs);
+    int addEntry(unsigned dir_block, const dir_entry &de);
+    int updateEntry(const file_ref &ref);
+    int removeEntry(const file_ref &ref);
+    int writeEntry(const file_ref &ref);
+    int initDirBlock(unsigned block_no, const dir_entry *first);
+    int getParent(unsigned dir_block);
     int traverseToDir(std::vector<std::string> filepath);
     uint8_t getDirAccessRights(int dir_block);
     void updateFAT(int block_start, uint32_t size);
+    int allocateChain(uint32_t size);
+    void freeChain(unsigned first_blk);
+    std::vector<unsigned> allocateBlocks(uint32_t size, unsigned goal);
+    std::vector<extent> getExtents(int first_blk);
+    void collectFiles(unsigned dir_block, std::vector<file_ref> &files);
+    int relocateFile(const file_ref &file, const std::vector<unsigned> &blocks);
+    std::vector<unsigned> getChain(int first_blk);
+    const std::vector<unsigned> &getBlockMap(unsigned first_blk);
+    void invalidateBlockMap(unsigned first_blk);
+    void clearBlockMaps();
     std::vector<std::string> interpretFilepath(std::string dirpath);
     std::string accessRightsToString(uint8_t access_rights);
 
 public:
-    FS();
+    FS(const fs_options &options = fs_options());
     ~FS();
-    // formats the disk, i.e., creates an empty file system
-    int format();
+    // formats the disk, i.e., creates an empty file system with no_blocks
+    // blocks of block_size bytes
+    int format(unsigned no_blocks = NO_BLOCKS, unsigned block_size = BLOCK_SIZE);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
-    // cat <filepath> reads the content of a file and prints it on the screen
-    int cat(std::string filepath);
+    // cat <filepath> reads the content of a file and writes it to out, the
+    // screen by default
+    int cat(std::string filepath, std::ostream &out = std::cout);
     // ls lists the content in the currect directory (files and sub-directories)
     int ls();
+    // readdir fills entries with the content of the directory <dirpath>,
+    // the parent is named ".." also in the root directory
+    int readdir(std::string dirpath, std::vector<file_stat> &entries);
+    // stat fills st with the name, size, type and access rights of <filepath>
+    int stat(std::string filepath, file_stat &st);
+    // stat <filepath> prints what stat returns for <filepath>
+    int printStat(std::string filepath);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
-    // <sourcepath> to a new file <destpath>
+    // <sourcepath> to a new file <destpath>. On v2 volumes the copy shares
+    // the blocks of the source until one of them is written.
     int cp(std::string sourcepath, std::string destpath);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
@@ -84,6 +388,48 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // open <filepath> opens an existing file for reading and/or writing,
+    // mode is READ, WRITE or both. Returns a file descriptor or -1.
+    int open(std::string filepath, uint8_t mode = READ);
+    // close <fd> frees the file descriptor fd
+    int close(int fd);
+    // pread reads at most count bytes at offset into buf, returns the
+    // number of bytes read, 0 at the end of the file, or -1
+    int pread(int fd, void *buf, uint32_t count, uint32_t offset);
+    // pwrite writes count bytes from buf at offset, the file grows if the
+    // bytes go past its end and any gap reads as zeros
+    int pwrite(int fd, const void *buf, uint32_t count, uint32_t offset);
+    // read and write are pread and pwrite at the position of fd, which
+    // moves past the bytes read or written
+    int read(int fd, void *buf, uint32_t count);
+    int write(int fd, const void *buf, uint32_t count);
+    // lseek sets the position of fd to offset from the start (SEEK_SET),
+    // the position (SEEK_CUR) or the end (SEEK_END), returns the position
+    int64_t lseek(int fd, int64_t offset, int whence);
+    // truncate sets the size of the file, new bytes are a hole that reads
+    // as zeros and takes no blocks until it is written
+    int truncate(int fd, uint32_t size);
+
+    // sync writes all modified blocks in the block cache to the disk
+    int sync();
+    // cache-stats prints the hit/miss counters of the block cache
+    int cacheStats();
+    // dedup-stats prints the space saved by dedup and shared chains, and
+    // what the dedup index lookups cost
+    int dedupStats();
+    // frag prints how fragmented the files and the free space are
+    int frag();
+    // du [dirpath] prints the space used below every directory in <dirpath>
+    int du(std::string dirpath = ".");
+    // find <name> prints the path of every file and directory named <name>
+    // below the current directory
+    int find(std::string name);
+    // tree [dirpath] prints all files and directories below <dirpath>
+    int tree(std::string dirpath = ".");
+    // defrag [budget] moves fragmented files into contiguous runs, at most
+    // budget blocks are moved per call so it can be run in small steps
+    int defragment(unsigned budget = DEFRAG_BUDGET);
 };
 
 #endif // __FS_H__
@@ -0,0 +1,128 @@
+#include <cstring>
+#include <vector>
+#include "lz.h"
+
+size_t
+lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+// writes the part of a length that does not fit in its nibble
+static uint8_t *
+put_length(uint8_t *op, size_t length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// writes one sequence, the last one has no match (match_length 0)
+static uint8_t *
+put_sequence(uint8_t *op, const uint8_t *literals, size_t no_literals, size_t offset, size_t match_length)
+{
+    uint8_t *token = op++;
+    size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    *token = (no_literals < 15 ? no_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (no_literals >= 15)
+        op = put_length(op, no_literals - 15);
+    std::memcpy(op, literals, no_literals);
+    op += no_literals;
+    if (!match_length)
+        return op;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (match_code >= 15)
+        op = put_length(op, match_code - 15);
+    return op;
+}
+
+size_t
+lz_compress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+    // last position where each hashed 4-byte sequence was seen, plus one
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+    uint8_t *op = dst;
+    size_t ip = 0, anchor = 0;
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t sequence;
+        std::memcpy(&sequence, src + ip, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = ip + 1;
+
+        if (!candidate || ip + 1 - candidate > LZ_MAX_OFFSET ||
+            std::memcmp(src + candidate - 1, src + ip, LZ_MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < n && src[match + length] == src[ip + length])
+            length++;
+
+        op = put_sequence(op, src + anchor, ip - anchor, ip - match, length);
+        ip += length;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+    return op - dst;
+}
+
+// reads the part of a length that did not fit in its nibble
+static bool
+get_length(const uint8_t *&ip, const uint8_t *end, size_t &length)
+{
+    uint8_t byte;
+    do {
+        if (ip == end)
+            return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+long
+lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dst_size)
+{
+    const uint8_t *ip = src, *end = src + n;
+    size_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t no_literals = token >> 4;
+        if (no_literals == 15 && !get_length(ip, end, no_literals))
+            return -1;
+        if (no_literals > (size_t)(end - ip) || no_literals > dst_size - op)
+            return -1;
+        std::memcpy(dst + op, ip, no_literals);
+        ip += no_literals;
+        op += no_literals;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t length = (token & 0x0F);
+        if (length == 15 && !get_length(ip, end, length))
+            return -1;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || length > dst_size - op)
+            return -1;
+
+        // the match may overlap the bytes it produces
+        for (size_t i = 0; i < length; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
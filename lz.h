@@ -0,0 +1,28 @@
+#include <cstdint>
+#include <cstddef>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#define LZ_MIN_MATCH 4   // shortest match that is encoded
+#define LZ_HASH_BITS 12  // size of the match finder's hash table
+#define LZ_MAX_OFFSET 0xFFFF
+
+// Small LZ77 codec in the style of LZ4, used for compressed files.
+// The data is a list of sequences. Each starts with a token byte, whose
+// high nibble is the number of literals and whose low nibble is the match
+// length minus LZ_MIN_MATCH. A nibble of 15 is continued by bytes that
+// are added to it until one is below 255. The literals follow the token,
+// then a 16-bit little endian offset back to the match, then the match
+// length bytes. The last sequence has literals only.
+
+// largest size lz_compress can return for n bytes of input
+size_t lz_bound(size_t n);
+// compresses n bytes from src to dst, which must have room for
+// lz_bound(n) bytes, and returns the compressed size
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst);
+// decompresses n bytes from src to dst, which has room for dst_size bytes.
+// Returns the decompressed size, or -1 if src is not valid.
+long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dst_size);
+
+#endif // __LZ_H__
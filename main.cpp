@@ -1,3 +1,6 @@
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
@@ -5,7 +8,50 @@
 int
 main(int argc, char **argv)
 {
-    Shell shell;
+    fs_options options;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:dq:t:z")) != -1) {
+        switch (opt) {
+        case 'b':
+            // disk backend: "pread" (default), "mmap" or "uring"
+            if (std::strcmp(optarg, "mmap") == 0)
+                options.disk.backend = BACKEND_MMAP;
+            else if (std::strcmp(optarg, "uring") == 0)
+                options.disk.backend = BACKEND_URING;
+            else if (std::strcmp(optarg, "pread") == 0)
+                options.disk.backend = BACKEND_PREAD;
+            else {
+                std::cerr << "Unknown disk backend: " << optarg << "\n";
+                return 1;
+            }
+            break;
+        case 'c':
+            // number of blocks kept in the block cache, 0 disables it
+            options.cache_blocks = std::atoi(optarg);
+            break;
+        case 'd':
+            // whole-file dedup: a new file shares the chain of a file with
+            // the same content
+            options.dedup = true;
+            break;
+        case 'q':
+            // io_uring queue depth
+            options.disk.queue_depth = std::atoi(optarg);
+            break;
+        case 't':
+            // threads used by du, find and tree, 0 is one per cpu
+            options.walk_threads = std::atoi(optarg);
+            break;
+        case 'z':
+            // compress the files that are created
+            options.compress = true;
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-b pread|mmap|uring] [-c cache_blocks] [-d] [-q queue_depth] [-t walk_threads] [-z]\n";
+            return 1;
+        }
+    }
+    Shell shell(options);
     shell.run();
     return 0;
 }
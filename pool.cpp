@@ -0,0 +1,67 @@
+#include "pool.h"
+
+WorkerPool::WorkerPool(unsigned no_threads)
+{
+    for (unsigned i = 0; i < no_threads; i++)
+        threads.emplace_back(&WorkerPool::worker, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+// waits for a job and helps with it until the pool is stopped
+void
+WorkerPool::worker()
+{
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        work_ready.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping)
+            return;
+        seen = generation;
+        drain(guard);
+    }
+}
+
+// runs calls of the current job until none are left, lock is held on
+// entry and on return
+void
+WorkerPool::drain(std::unique_lock<std::mutex> &guard)
+{
+    busy++;
+    while (next < job_size) {
+        unsigned i = next++;
+        guard.unlock();
+        (*job)(i);
+        guard.lock();
+    }
+    if (--busy == 0)
+        work_done.notify_all();
+}
+
+// calls fn(0) .. fn(n - 1) spread over the threads, returns when all
+// calls are done
+void
+WorkerPool::run(unsigned n, const std::function<void(unsigned)> &fn)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    job = &fn;
+    job_size = n;
+    next = 0;
+    generation++;
+    if (!threads.empty())
+        work_ready.notify_all();
+    drain(guard);
+    work_done.wait(guard, [&] { return busy == 0; });
+    job = nullptr;
+    job_size = 0;
+}
@@ -0,0 +1,36 @@
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+// Fixed set of worker threads that run the calls of one job at a time.
+// The thread calling run() takes part in the job as well, so a pool with
+// no threads runs everything on the caller.
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    const std::function<void(unsigned)> *job = nullptr;
+    unsigned job_size = 0;
+    unsigned next = 0;  // next index of the job to hand out
+    unsigned busy = 0;  // threads working on the job
+    unsigned long generation = 0;
+    bool stopping = false;
+    void worker();
+    void drain(std::unique_lock<std::mutex> &guard);
+public:
+    WorkerPool(unsigned no_threads);
+    ~WorkerPool();
+    // calls fn(0) .. fn(n - 1) spread over the threads, returns when all
+    // calls are done
+    void run(unsigned n, const std::function<void(unsigned)> &fn);
+    unsigned get_no_threads() { return threads.size(); }
+};
+
+#endif // __POOL_H__
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <cstdlib>
+#include <cctype>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -7,13 +9,15 @@
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
-    "cp", "mv", "rm", "append",
+    "cp", "mv", "rm", "append", "truncate",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "stat",
+    "du", "find", "tree",
+    "sync", "cache-stats", "dedup-stats", "frag", "defrag",
     "help", "quit"
 };
 
-Shell::Shell()
+Shell::Shell(const fs_options &options) : filesystem(options)
 {
     std::cout << "Starting shell...\n";
 }
@@ -66,12 +70,16 @@ Shell::run()
         }
 
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            unsigned long long no_blocks = NO_BLOCKS;
+            char *end = nullptr;
+            if (cmd_line.size() == 2 && std::isdigit((unsigned char)cmd_line[1][0]))
+                no_blocks = std::strtoull(cmd_line[1].c_str(), &end, 10);
+            if (cmd_line.size() > 2 || (cmd_line.size() == 2 && (!end || *end != '\0')) || no_blocks > UINT32_MAX) {
+                std::cout << "Usage: format [no_blocks]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(no_blocks);
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
@@ -177,6 +185,32 @@ Shell::run()
             }
         }
 
+        else if (cmd == "truncate") {
+            unsigned long long size = 0;
+            char *end = nullptr;
+            if (cmd_line.size() == 4 && cmd_line[1] == "-s" && std::isdigit((unsigned char)cmd_line[2][0])) {
+                size = std::strtoull(cmd_line[2].c_str(), &end, 10);
+                // a K, M or G suffix counts in KiB, MiB or GiB
+                std::string units = "KMG";
+                if (*end && units.find(*end) != std::string::npos)
+                    size <<= 10 * (units.find(*end++) + 1);
+            }
+            if (!end || *end != '\0' || size > UINT32_MAX) {
+                std::cout << "Usage: truncate -s <size>[K|M|G] <file>\n";
+                continue;
+            }
+            arg1 = cmd_line[3];
+            // check return value so everything is ok
+            int fd = filesystem.open(arg1, WRITE);
+            ret_val = fd == -1 ? -1 : filesystem.truncate(fd, size);
+            if (fd != -1)
+                filesystem.close(fd);
+            if (ret_val) {
+                std::cout << "Error: truncate " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "mkdir") {
             if (cmd_line.size() != 2) {
                 std::cout << "Usage: mkdir <dirpath>\n";
@@ -232,12 +266,132 @@ Shell::run()
             }
         }
 
+        else if (cmd == "stat") {
+            if (cmd_line.size() != 2) {
+                std::cout << "Usage: stat <file>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            // check return value so everything is ok
+            ret_val = filesystem.printStat(arg1);
+            if (ret_val) {
+                std::cout << "Error: stat " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "du") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: du [dir]\n";
+                continue;
+            }
+            arg1 = cmd_line.size() == 2 ? cmd_line[1] : ".";
+            // check return value so everything is ok
+            ret_val = filesystem.du(arg1);
+            if (ret_val) {
+                std::cout << "Error: du " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "find") {
+            if (cmd_line.size() != 2) {
+                std::cout << "Usage: find <name>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            // check return value so everything is ok
+            ret_val = filesystem.find(arg1);
+            if (ret_val) {
+                std::cout << "Error: find " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "tree") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: tree [dir]\n";
+                continue;
+            }
+            arg1 = cmd_line.size() == 2 ? cmd_line[1] : ".";
+            // check return value so everything is ok
+            ret_val = filesystem.tree(arg1);
+            if (ret_val) {
+                std::cout << "Error: tree " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "cache-stats") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: cache-stats\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.cacheStats();
+            if (ret_val) {
+                std::cout << "Error: cache-stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "dedup-stats") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: dedup-stats\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.dedupStats();
+            if (ret_val) {
+                std::cout << "Error: dedup-stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "frag") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: frag\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.frag();
+            if (ret_val) {
+                std::cout << "Error: frag failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "defrag") {
+            unsigned long budget = DEFRAG_BUDGET;
+            char *end = nullptr;
+            if (cmd_line.size() == 2)
+                budget = std::strtoul(cmd_line[1].c_str(), &end, 10);
+            if (cmd_line.size() > 2 || (end && *end != '\0')) {
+                std::cout << "Usage: defrag [budget]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.defragment(budget);
+            if (ret_val) {
+                std::cout << "Error: defrag failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, truncate, mkdir, cd, pwd, chmod, stat, du, find, tree, sync, cache-stats, dedup-stats, frag, defrag, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -246,7 +400,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, truncate, mkdir, cd, pwd, chmod, stat, du, find, tree, sync, cache-stats, dedup-stats, frag, defrag, help, quit\n";
         }
     }
 }
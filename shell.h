@@ -8,7 +8,7 @@ class Shell {
 private:
     FS filesystem;
 public:
-    Shell();
+    Shell(const fs_options &options = fs_options());
     ~Shell();
     void run();
 };
@@ -0,0 +1,171 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+IoUring::IoUring(unsigned depth)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0)
+        return;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        close(fd);
+        return;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            munmap(sq_ring, sq_ring_size);
+            sq_ring = nullptr;
+            close(fd);
+            return;
+        }
+    }
+    void *sqe_area = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqe_area == MAP_FAILED) {
+        if (cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = cq_ring = nullptr;
+        close(fd);
+        return;
+    }
+    sqes = (io_uring_sqe *)sqe_area;
+
+    uint8_t *sq = (uint8_t *)sq_ring;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    uint8_t *cq = (uint8_t *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring_fd = fd;
+    this->depth = params.sq_entries;
+}
+
+IoUring::~IoUring()
+{
+    if (ring_fd == -1)
+        return;
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+// queues a read (or write if to_disk) of len bytes at offset in fd,
+// returns false if the submission queue is full
+bool
+IoUring::queue(bool to_disk, int fd, uint8_t *buf, size_t len, off_t offset, uint64_t tag)
+{
+    unsigned tail = *sq_tail;
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= depth)
+        return false;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = to_disk ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+    return true;
+}
+
+// hands the queued requests to the kernel and waits until at least
+// min_complete of them have completed
+int
+IoUring::submit(unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        int ret = syscall(__NR_io_uring_enter, ring_fd, pending, min_complete, flags, nullptr, 0);
+        if (ret >= 0) {
+            pending -= ret;
+            return 0;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+// pops one completion, returns false if there is none
+bool
+IoUring::reap(uint64_t &tag, int &result)
+{
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    tag = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+// io_uring is not available in this build, ok() is always false
+IoUring::IoUring(unsigned depth)
+{
+}
+
+IoUring::~IoUring()
+{
+}
+
+bool
+IoUring::queue(bool to_disk, int fd, uint8_t *buf, size_t len, off_t offset, uint64_t tag)
+{
+    return false;
+}
+
+int
+IoUring::submit(unsigned min_complete)
+{
+    return -1;
+}
+
+bool
+IoUring::reap(uint64_t &tag, int &result)
+{
+    return false;
+}
+
+#endif // HAVE_IO_URING
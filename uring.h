@@ -0,0 +1,52 @@
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#define URING_QUEUE_DEPTH 32
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Minimal io_uring submission/completion ring driven by the raw system
+// calls, so there is no dependency on liburing. Requests are queued with
+// queue(), handed to the kernel with submit() and collected with reap().
+class IoUring {
+private:
+    int ring_fd = -1;
+    unsigned depth = 0;
+    unsigned pending = 0;
+    // submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+public:
+    IoUring(unsigned depth);
+    ~IoUring();
+    // false if io_uring is not supported by the build or the kernel
+    bool ok() { return ring_fd != -1; }
+    unsigned get_depth() { return depth; }
+    // queues a read (or write if to_disk) of len bytes at offset in fd,
+    // returns false if the submission queue is full
+    bool queue(bool to_disk, int fd, uint8_t *buf, size_t len, off_t offset, uint64_t tag);
+    // hands the queued requests to the kernel and waits until at least
+    // min_complete of them have completed
+    int submit(unsigned min_complete);
+    // pops one completion, returns false if there is none
+    bool reap(uint64_t &tag, int &result);
+};
+
+#endif // __URING_H__